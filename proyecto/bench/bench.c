@@ -0,0 +1,471 @@
+// Loopback benchmark of the serial port protocol.
+// Creates two pseudo-terminals joined by an in-process forwarder (no socat and
+// no sudo needed), runs the receiver and the transmitter as child processes and
+// writes one CSV line per combination of the swept parameters.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "application_layer.h"
+#include "channel.h"
+#include "link_layer.h"
+#include "pty_pair.h"
+
+#define BUF_SIZE 2048
+#define MAX_LIST 16
+
+#define DEFAULT_FILE_SIZE 32768
+#define DEFAULT_TRIES 3
+
+// One direction of the emulated cable
+typedef struct
+{
+    int fdIn;
+    int fdOut;
+    Channel channel;
+    volatile int *stop;
+} Direction;
+
+// Result of one child process, sent through a pipe
+typedef struct
+{
+    LinkLayerStats stats;
+} ChildReport;
+
+typedef struct
+{
+    double values[MAX_LIST];
+    int count;
+} List;
+
+// Transmitter sends from a memory mapping (-m)
+static int mapFile = 0;
+
+// Generated input is a sparse file of zeros (-z)
+static int sparseInput = 0;
+
+// Bytes of random data at the end of the sparse input (-D)
+static long sparseData = 0;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *forward(void *arg)
+{
+    Direction *dir = (Direction *)arg;
+    unsigned char buf[BUF_SIZE];
+
+    struct pollfd pfd = {dir->fdIn, POLLIN, 0};
+
+    while (!*dir->stop)
+    {
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+
+        int n = read(dir->fdIn, buf, BUF_SIZE);
+        if (n <= 0)
+            continue;
+
+        channelCorrupt(&dir->channel, buf, n);
+
+        // Hold the bytes until the emulated line has shifted them out
+        double wait = channelSchedule(&dir->channel, n, now()) - now();
+        if (wait > 0)
+        {
+            struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+            nanosleep(&ts, NULL);
+        }
+
+        if (write(dir->fdOut, buf, n) != n)
+            continue;
+    }
+
+    return NULL;
+}
+
+static int parseList(const char *text, List *list)
+{
+    list->count = 0;
+    char *copy = strdup(text);
+    for (char *item = strtok(copy, ","); item != NULL && list->count < MAX_LIST; item = strtok(NULL, ","))
+        list->values[list->count++] = atof(item);
+    free(copy);
+    return list->count;
+}
+
+// Parse a size with an optional K, M or G (binary) suffix.
+static long parseSize(const char *text)
+{
+    char *end;
+    long size = strtol(text, &end, 10);
+    switch (*end)
+    {
+    case 'G': size <<= 10; // fall through
+    case 'M': size <<= 10; // fall through
+    case 'K': size <<= 10; break;
+    }
+    return size;
+}
+
+// Compare the copy with the input byte by byte, and print where they first differ.
+static int sameFiles(const char *input, const char *copy)
+{
+    FILE *fa = fopen(input, "rb");
+    FILE *fb = fopen(copy, "rb");
+    int same = fa != NULL && fb != NULL;
+    static unsigned char bufA[1 << 16], bufB[1 << 16];
+
+    struct stat sa, sb;
+    if (same && fstat(fileno(fa), &sa) == 0 && fstat(fileno(fb), &sb) == 0 && sa.st_size != sb.st_size)
+    {
+        printf("Copy has %lld bytes instead of %lld\n", (long long)sb.st_size, (long long)sa.st_size);
+        same = 0;
+    }
+
+    long long offset = 0;
+    while (same)
+    {
+        size_t na = fread(bufA, 1, sizeof(bufA), fa);
+        size_t nb = fread(bufB, 1, sizeof(bufB), fb);
+        size_t n = na < nb ? na : nb;
+        if (na != nb || memcmp(bufA, bufB, n) != 0)
+        {
+            size_t i = 0;
+            while (i < n && bufA[i] == bufB[i])
+                i++;
+            printf("Copy differs from the input at byte %lld\n", offset + (long long)i);
+            same = 0;
+        }
+        if (na == 0 || nb == 0)
+            break;
+        offset += n;
+    }
+
+    if (fa != NULL)
+        fclose(fa);
+    if (fb != NULL)
+        fclose(fb);
+    return same;
+}
+
+// Run the application layer in a child process, with its output silenced.
+static pid_t spawn(const char *port, const char *role, int baudRate, int tries, double timeout,
+                   const char *filename, int payloadSize, int reportFd, int closeFds[4])
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    for (int i = 0; i < 4; i++)
+        close(closeFds[i]);
+
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+
+    ApplicationLayerOptions options;
+    memset(&options, 0, sizeof(options));
+    options.payloadSize = payloadSize;
+    options.mapFile = mapFile;
+    applicationLayerSetOptions(&options);
+    applicationLayer(port, role, baudRate, tries, timeout, filename);
+
+    ChildReport report;
+    llstats(&report.stats);
+    if (write(reportFd, &report, sizeof(report)) != sizeof(report))
+        _exit(1);
+    _exit(0);
+}
+
+static double cpuSeconds(const struct rusage *usage)
+{
+    return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+// Transfer the file once. Return "1" if the copy is good, "0" if the transfer failed
+// or "-1" if the run could not be set up.
+static int runOnce(FILE *csv, const char *label, const char *input, long fileSize, int payloadSize,
+                   int baudRate, double timeout, double ber, int tries, uint64_t seed)
+{
+    int masterTx, slaveTx, masterRx, slaveRx;
+    char nameTx[64], nameRx[64];
+
+    if (ptyOpen(&masterTx, &slaveTx, nameTx, sizeof(nameTx)) == -1 ||
+        ptyOpen(&masterRx, &slaveRx, nameRx, sizeof(nameRx)) == -1)
+    {
+        perror("openpty");
+        return -1;
+    }
+
+    char output[] = "/tmp/bench-rx-XXXXXX";
+    int outFd = mkstemp(output);
+    if (outFd == -1)
+    {
+        perror("mkstemp");
+        return -1;
+    }
+    close(outFd);
+
+    ChannelParams params;
+    memset(&params, 0, sizeof(params));
+    params.ber = ber;
+    params.baudRate = baudRate;
+
+    volatile int stop = 0;
+    Direction toRx = {.fdIn = masterTx, .fdOut = masterRx, .stop = &stop};
+    Direction toTx = {.fdIn = masterRx, .fdOut = masterTx, .stop = &stop};
+    channelInit(&toRx.channel, &params, seed);
+    channelInit(&toTx.channel, &params, seed + 1);
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, forward, &toRx);
+    pthread_create(&threads[1], NULL, forward, &toTx);
+
+    int txPipe[2], rxPipe[2];
+    if (pipe(txPipe) == -1 || pipe(rxPipe) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    // The application layer only knows termios baudrates
+    int appBaudRate = baudRate > 0 ? baudRate : 38400;
+    int closeFds[4] = {masterTx, masterRx, slaveTx, slaveRx};
+
+    pid_t rx = spawn(nameRx, "rx", appBaudRate, tries, timeout, output, 0, rxPipe[1], closeFds);
+    usleep(100000);
+
+    double start = now();
+    pid_t tx = spawn(nameTx, "tx", appBaudRate, tries, timeout, input, payloadSize, txPipe[1], closeFds);
+    close(txPipe[1]);
+    close(rxPipe[1]);
+
+    struct rusage txUsage, rxUsage;
+    int status;
+    memset(&txUsage, 0, sizeof(txUsage));
+    memset(&rxUsage, 0, sizeof(rxUsage));
+    wait4(tx, &status, 0, &txUsage);
+    int txOk = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    // A receiver left without transmitter would wait forever
+    double deadline = now() + tries * timeout + 2;
+    while (wait4(rx, &status, WNOHANG, &rxUsage) == 0)
+    {
+        if (now() > deadline)
+        {
+            kill(rx, SIGKILL);
+            wait4(rx, &status, 0, &rxUsage);
+            break;
+        }
+        usleep(10000);
+    }
+    double elapsed = now() - start;
+
+    ChildReport txReport, rxReport;
+    memset(&txReport, 0, sizeof(txReport));
+    memset(&rxReport, 0, sizeof(rxReport));
+    if (read(txPipe[0], &txReport, sizeof(txReport)) != sizeof(txReport))
+        txOk = 0;
+    if (read(rxPipe[0], &rxReport, sizeof(rxReport)) != sizeof(rxReport))
+        memset(&rxReport, 0, sizeof(rxReport));
+    close(txPipe[0]);
+    close(rxPipe[0]);
+
+    stop = 1;
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    close(masterTx);
+    close(masterRx);
+    close(slaveTx);
+    close(slaveRx);
+
+    int ok = txOk && sameFiles(input, output);
+    unlink(output);
+
+    double throughput = fileSize * 8 / elapsed;
+    double efficiency = baudRate > 0 ? throughput / baudRate : 0;
+
+    fprintf(csv, "%s,%d,%d,%g,%g,%llu,%ld,%.6f,%.1f,%.4f,%lu,%lu,%lu,%lu,%.6f,%.6f,%ld,%ld,%d\n",
+            label, payloadSize, baudRate, timeout, ber, (unsigned long long)seed, fileSize, elapsed,
+            throughput, efficiency, txReport.stats.framesSent, txReport.stats.retransmissions,
+            txReport.stats.timeouts, rxReport.stats.framesRejected, cpuSeconds(&txUsage), cpuSeconds(&rxUsage),
+            txUsage.ru_maxrss, rxUsage.ru_maxrss, ok);
+    fflush(csv);
+
+    printf("payload=%d baud=%d timeout=%g ber=%g: %.3f s, %.0f bps, %lu retransmissions%s\n",
+           payloadSize, baudRate, timeout, ber, elapsed, throughput,
+           txReport.stats.retransmissions, ok ? "" : " (FAILED)");
+    return ok;
+}
+
+// Write size bytes of random data at offset.
+static int writeRandom(int fd, long offset, long size)
+{
+    uint64_t random = 0x9E3779B97F4A7C15ULL;
+    unsigned char buf[BUF_SIZE];
+    for (long written = 0; written < size;)
+    {
+        for (int i = 0; i < BUF_SIZE; i += 8)
+        {
+            random ^= random >> 12;
+            random ^= random << 25;
+            random ^= random >> 27;
+            uint64_t value = random * 0x2545F4914F6CDD1DULL;
+            memcpy(buf + i, &value, 8);
+        }
+        int n = size - written > BUF_SIZE ? BUF_SIZE : size - written;
+        if (pwrite(fd, buf, n, offset + written) != n)
+            return -1;
+        written += n;
+    }
+    return 0;
+}
+
+// Create a random file to send when none is given.
+static int createInput(char *path, long size)
+{
+    int fd = mkstemp(path);
+    if (fd == -1)
+        return -1;
+
+    // Multi-GB runs need no disk space or time to create their input, only the
+    // data at the end (past 4 GiB for the large run) is written
+    int result;
+    if (sparseInput)
+    {
+        long data = sparseData < size ? sparseData : size;
+        result = ftruncate(fd, size) == -1 ? -1 : writeRandom(fd, size - data, data);
+    }
+    else
+        result = writeRandom(fd, 0, size);
+
+    close(fd);
+    return result;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [options]\n"
+           "  -f FILE     file to send (default: random file of -S bytes)\n"
+           "  -S BYTES    size of the random file, K, M or G suffix allowed (default %d)\n"
+           "  -z          generate a sparse file of zeros instead of random data\n"
+           "  -D BYTES    with -z, end the file with BYTES of random data (default 0)\n"
+           "  -o CSV      append results to CSV (default: stdout)\n"
+           "  -l LABEL    label of this build in the CSV\n"
+           "  -p LIST     payload sizes (default 256,1000)\n"
+           "  -b LIST     line baudrates, 0 = unlimited (default 38400,115200)\n"
+           "  -t LIST     timeouts in seconds (default 1)\n"
+           "  -e LIST     bit error rates (default 0,0.00001)\n"
+           "  -n TRIES    number of tries per frame (default %d)\n"
+           "  -s SEED     random seed (default 1)\n"
+           "  -m          transmitter sends from a memory mapping of the file\n",
+           name, DEFAULT_FILE_SIZE, DEFAULT_TRIES);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *input = NULL;
+    const char *csvPath = NULL;
+    const char *label = "";
+    long fileSize = DEFAULT_FILE_SIZE;
+    int tries = DEFAULT_TRIES;
+    uint64_t seed = 1;
+    List payloads, bauds, timeouts, errors;
+
+    parseList("256,1000", &payloads);
+    parseList("38400,115200", &bauds);
+    parseList("1", &timeouts);
+    parseList("0,0.00001", &errors);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "f:S:o:l:p:b:t:e:n:s:mzD:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f': input = optarg; break;
+        case 'S': fileSize = parseSize(optarg); break;
+        case 'o': csvPath = optarg; break;
+        case 'l': label = optarg; break;
+        case 'p': parseList(optarg, &payloads); break;
+        case 'b': parseList(optarg, &bauds); break;
+        case 't': parseList(optarg, &timeouts); break;
+        case 'e': parseList(optarg, &errors); break;
+        case 'n': tries = atoi(optarg); break;
+        case 's': seed = strtoull(optarg, NULL, 0); break;
+        case 'm': mapFile = 1; break;
+        case 'z': sparseInput = 1; break;
+        case 'D': sparseData = parseSize(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    char generated[] = "/tmp/bench-tx-XXXXXX";
+    if (input == NULL)
+    {
+        if (createInput(generated, fileSize) == -1)
+        {
+            perror("Creating input file");
+            return 1;
+        }
+        input = generated;
+    }
+
+    struct stat st;
+    if (stat(input, &st) == -1)
+    {
+        perror(input);
+        return 1;
+    }
+    fileSize = st.st_size;
+
+    FILE *csv = stdout;
+    if (csvPath != NULL)
+    {
+        csv = fopen(csvPath, "a");
+        if (csv == NULL)
+        {
+            perror(csvPath);
+            return 1;
+        }
+    }
+    if (ftell(csv) <= 0)
+        fprintf(csv, "label,payload,baud,timeout,ber,seed,file_bytes,seconds,throughput_bps,"
+                     "efficiency,frames,retransmissions,timeouts,rejects,tx_cpu_s,rx_cpu_s,tx_rss_kb,rx_rss_kb,ok\n");
+
+    int failed = 0;
+    for (int p = 0; p < payloads.count; p++)
+        for (int b = 0; b < bauds.count; b++)
+            for (int t = 0; t < timeouts.count; t++)
+                for (int e = 0; e < errors.count; e++)
+                {
+                    if (runOnce(csv, label, input, fileSize, (int)payloads.values[p], (int)bauds.values[b],
+                                timeouts.values[t], errors.values[e], tries, seed) != 1)
+                        failed = 1;
+                }
+
+    if (csv != stdout)
+        fclose(csv);
+    if (input == generated)
+        unlink(generated);
+
+    return failed;
+}
@@ -0,0 +1,299 @@
+// Microbenchmark of the framing kernels (see include/framing.h).
+// Times BCC, stuffing, destuffing and the frame parser on their own, over
+// inputs that are the worst and usual cases for them (every byte a flag, every
+// byte an escape, random data and real files), and prints ns/byte and GB/s of
+// payload for each. Each dataset is cut into MAX_PAYLOAD_SIZE packets like the
+// link layer does, and the kernels are checked against each other first.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "framing.h"
+#include "link_layer.h"
+
+#define DATASET_SIZE (1 << 20)
+#define MAX_FILE_SIZE (16 << 20)
+#define DEFAULT_MIN_SECONDS 0.25
+
+// Compiler flags of the build, given by the Makefile
+#ifndef MICROBENCH_FLAGS
+#define MICROBENCH_FLAGS "unknown"
+#endif
+
+// Bytes handed to the parser per call, as llprocess() reads them
+#define PARSE_CHUNK 4096
+
+// Frame bytes around the stuffed packet: flag, address, control, BCC1, flag
+#define FRAME_HEADER 4
+
+typedef struct
+{
+    char name[64];
+    unsigned char *data;
+    size_t size;
+    unsigned char *stuffed; // Each packet and its BCC2, stuffed, back to back
+    size_t *stuffedSizes;   // Per packet
+    unsigned char *wire;    // The packets as complete frames
+    size_t wireSize;
+    size_t packets;
+} Dataset;
+
+static double minSeconds = DEFAULT_MIN_SECONDS;
+static volatile unsigned sink; // Keeps the results alive
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t packetSize(const Dataset *set, size_t packet)
+{
+    size_t left = set->size - packet * MAX_PAYLOAD_SIZE;
+    return left > MAX_PAYLOAD_SIZE ? MAX_PAYLOAD_SIZE : left;
+}
+
+// Stuff every packet once, for the destuffing and parsing runs.
+static int prepare(Dataset *set)
+{
+    set->packets = (set->size + MAX_PAYLOAD_SIZE - 1) / MAX_PAYLOAD_SIZE;
+    set->stuffed = (unsigned char *)malloc(2 * (set->size + set->packets));
+    set->stuffedSizes = (size_t *)malloc(set->packets * sizeof(size_t));
+    set->wire = (unsigned char *)malloc(2 * (set->size + set->packets) + set->packets * (FRAME_HEADER + 1));
+    if (set->stuffed == NULL || set->stuffedSizes == NULL || set->wire == NULL)
+        return -1;
+
+    size_t stuffed = 0;
+    set->wireSize = 0;
+    for (size_t p = 0; p < set->packets; p++)
+    {
+        const unsigned char *data = set->data + p * MAX_PAYLOAD_SIZE;
+        unsigned char bcc = 0, unused = 0;
+        size_t n = frameStuff(set->stuffed + stuffed, data, packetSize(set, p), &bcc);
+        n += frameStuff(set->stuffed + stuffed + n, &bcc, 1, &unused);
+        set->stuffedSizes[p] = n;
+
+        unsigned char *frame = set->wire + set->wireSize;
+        frame[0] = FRAME_FLAG;
+        frame[1] = 0x03;
+        frame[2] = 0x00;
+        frame[3] = frame[1] ^ frame[2];
+        memcpy(frame + FRAME_HEADER, set->stuffed + stuffed, n);
+        frame[FRAME_HEADER + n] = FRAME_FLAG;
+        set->wireSize += FRAME_HEADER + n + 1;
+        stuffed += n;
+    }
+    return 0;
+}
+
+// Destuffing and parsing must give back every packet and its BCC2.
+static int check(const Dataset *set)
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE + 1];
+    unsigned char frame[2 * MAX_PAYLOAD_SIZE + 8];
+    FrameParser parser;
+    frameParserInit(&parser, frame, sizeof(frame));
+
+    const unsigned char *stuffed = set->stuffed;
+    const unsigned char *wire = set->wire;
+    size_t wireLeft = set->wireSize;
+    for (size_t p = 0; p < set->packets; p++)
+    {
+        const unsigned char *data = set->data + p * MAX_PAYLOAD_SIZE;
+        size_t size = packetSize(set, p);
+        int n = frameDestuff(packet, sizeof(packet), stuffed, set->stuffedSizes[p]);
+        if (n != (int)size + 1 || memcmp(packet, data, size) != 0 || frameBcc(0, data, size) != packet[size])
+            return -1;
+        stuffed += set->stuffedSizes[p];
+
+        int consumed;
+        int frameSize = frameParse(&parser, wire, wireLeft, &consumed);
+        if (frameSize != (int)size + 4 || memcmp(parser.frame + 3, data, size) != 0)
+            return -1;
+        wire += consumed;
+        wireLeft -= consumed;
+    }
+    return 0;
+}
+
+static double runBcc(const Dataset *set)
+{
+    unsigned bcc = 0;
+    for (size_t p = 0; p < set->packets; p++)
+        bcc += frameBcc(0, set->data + p * MAX_PAYLOAD_SIZE, packetSize(set, p));
+    sink += bcc;
+    return set->size;
+}
+
+static double runStuff(const Dataset *set)
+{
+    unsigned char out[2 * MAX_PAYLOAD_SIZE];
+    size_t total = 0;
+    for (size_t p = 0; p < set->packets; p++)
+    {
+        unsigned char bcc = 0;
+        total += frameStuff(out, set->data + p * MAX_PAYLOAD_SIZE, packetSize(set, p), &bcc);
+    }
+    sink += total;
+    return set->size;
+}
+
+static double runDestuff(const Dataset *set)
+{
+    unsigned char out[MAX_PAYLOAD_SIZE + 1];
+    const unsigned char *stuffed = set->stuffed;
+    size_t total = 0;
+    for (size_t p = 0; p < set->packets; p++)
+    {
+        total += frameDestuff(out, sizeof(out), stuffed, set->stuffedSizes[p]);
+        stuffed += set->stuffedSizes[p];
+    }
+    sink += total;
+    return set->size;
+}
+
+static double runParse(const Dataset *set)
+{
+    unsigned char frame[2 * MAX_PAYLOAD_SIZE + 8];
+    FrameParser parser;
+    frameParserInit(&parser, frame, sizeof(frame));
+
+    size_t frames = 0;
+    for (size_t done = 0; done < set->wireSize; done += PARSE_CHUNK)
+    {
+        const unsigned char *bytes = set->wire + done;
+        int left = set->wireSize - done > PARSE_CHUNK ? PARSE_CHUNK : (int)(set->wireSize - done);
+        while (left > 0)
+        {
+            int consumed;
+            if (frameParse(&parser, bytes, left, &consumed) > 0)
+                frames++;
+            bytes += consumed;
+            left -= consumed;
+        }
+    }
+    sink += frames;
+    return set->size;
+}
+
+// Run kernel over the dataset until minSeconds have passed and print the rate
+// per payload byte.
+static void measure(const char *kernel, double (*run)(const Dataset *), const Dataset *set)
+{
+    double bytes = run(set); // Warm up the caches
+    bytes = 0;
+    double start = now(), elapsed;
+    do
+    {
+        bytes += run(set);
+        elapsed = now() - start;
+    } while (elapsed < minSeconds);
+
+    printf("%-8s %-24s %10.3f %10.3f\n", kernel, set->name, elapsed * 1e9 / bytes, bytes / elapsed / 1e9);
+}
+
+static int loadFile(Dataset *set, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return -1;
+    set->data = (unsigned char *)malloc(MAX_FILE_SIZE);
+    set->size = set->data != NULL ? fread(set->data, 1, MAX_FILE_SIZE, file) : 0;
+    fclose(file);
+
+    const char *name = strrchr(path, '/');
+    snprintf(set->name, sizeof(set->name), "%s", name != NULL ? name + 1 : path);
+    return set->size > 0 ? 0 : -1;
+}
+
+static void fill(Dataset *set, const char *name, int byte)
+{
+    snprintf(set->name, sizeof(set->name), "%s", name);
+    set->size = DATASET_SIZE;
+    set->data = (unsigned char *)malloc(DATASET_SIZE);
+    if (byte >= 0)
+    {
+        memset(set->data, byte, DATASET_SIZE);
+        return;
+    }
+
+    uint64_t random = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < DATASET_SIZE; i += 8)
+    {
+        random ^= random >> 12;
+        random ^= random << 25;
+        random ^= random >> 27;
+        uint64_t value = random * 0x2545F4914F6CDD1DULL;
+        memcpy(set->data + i, &value, 8);
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-t SECONDS] [FILE...]\n"
+           "Time the framing kernels over all 0x7E, all 0x7D and random data, and each FILE\n"
+           "(its first %d MiB).\n"
+           "  -t SECONDS  minimum time per measurement (default %g)\n",
+           name, MAX_FILE_SIZE >> 20, DEFAULT_MIN_SECONDS);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': minSeconds = atof(optarg); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int count = 3 + argc - optind;
+    Dataset *sets = (Dataset *)calloc(count, sizeof(Dataset));
+    fill(&sets[0], "flags (0x7E)", FRAME_FLAG);
+    fill(&sets[1], "escapes (0x7D)", FRAME_ESC);
+    fill(&sets[2], "random", -1);
+    for (int i = optind; i < argc; i++)
+    {
+        if (loadFile(&sets[3 + i - optind], argv[i]) == -1)
+        {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (prepare(&sets[i]) == -1 || check(&sets[i]) == -1)
+        {
+            printf("Framing kernels disagree on %s.\n", sets[i].name);
+            return 1;
+        }
+    }
+
+    printf("Built with: %s\n", MICROBENCH_FLAGS);
+    printf("%-8s %-24s %10s %10s\n", "kernel", "input", "ns/byte", "GB/s");
+    const char *kernels[] = {"bcc", "stuff", "destuff", "parse"};
+    double (*runs[])(const Dataset *) = {runBcc, runStuff, runDestuff, runParse};
+    for (int k = 0; k < 4; k++)
+        for (int i = 0; i < count; i++)
+            measure(kernels[k], runs[k], &sets[i]);
+
+    for (int i = 0; i < count; i++)
+    {
+        free(sets[i].data);
+        free(sets[i].stuffed);
+        free(sets[i].stuffedSizes);
+        free(sets[i].wire);
+    }
+    free(sets);
+    return 0;
+}
@@ -1,26 +1,65 @@
 // Virtual cable program to test serial port.
-// Creates a pair of virtual Tx / Rx serial ports using "socat".
+// Creates pairs of virtual Tx / Rx serial ports from pseudo-terminals and
+// publishes them as symlinks, so several cables can run side by side.
+// One cable can emulate several independent links (hub mode), or one
+// transmitter broadcasting to several receivers. Every port, timer and the
+// console are multiplexed with epoll, so bytes are forwarded as soon as they
+// arrive.
 //
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
-// Baudrate settings are defined in <asm/termbits.h>, which is
-// included by <termios.h>
-#define BAUDRATE B38400
-#define _POSIX_SOURCE 1 // POSIX compliant source
+#include "capture.h"
+#include "channel.h"
+#include "pty_pair.h"
+#include "schedule.h"
+
 #define FALSE 0
 #define TRUE 1
 
-#define BUF_SIZE 2048
+#define BUF_SIZE 4096
+#define PATH_SIZE 256
+#define MAX_EVENTS 64
+// Bytes a direction holds for a port that is not being read, beyond them it overruns
+#define OUTPUT_BACKLOG 65536
+
+// Links of one cable; link k has directions 2k (from its transmitter) and 2k + 1
+#define MAX_LINKS 32
+#define MAX_PORTS (2 * MAX_LINKS)
+#define MAX_DIRECTIONS (2 * MAX_LINKS)
+
+// Port p is published as ttyS<FIRST_PORT + p>
+#define FIRST_PORT 10
+
+// Bytes in flight on a slow or long line are held in slices of SLICE_SIZE bytes,
+// each released when its last bit reaches the other end
+#define SLICE_SIZE 64
+#define QUEUE_SLICES 16384
+
+// A schedule without "end" finishes when the line stays idle this long after its last event
+#define SCHEDULE_IDLE_EXIT 5.0
+
+// Bit error rate of the "noise" mode when no error model is given
+#define DEFAULT_NOISE_BER 1e-4
+
+// Where the serial ports are published when no directory is given: a directory
+// of the user, so no root is needed ($XDG_RUNTIME_DIR/cable, else /tmp/cable.<uid>)
+#define DEFAULT_LINK_DIR "cable"
+#define FALLBACK_LINK_DIR "/tmp/cable.%u"
 
 typedef enum
 {
@@ -29,187 +68,989 @@ typedef enum
     CableModeNoise,
 } CableMode;
 
-// Returns: serial port file descriptor (fd).
-int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
+typedef struct
+{
+    double arrival;
+    int size;
+    unsigned char data[SLICE_SIZE];
+} Slice;
+
+// One serial port of the cable: the cable keeps the master of a pty pair and
+// the protocol opens the slave through the published link
+typedef struct
+{
+    char link[PATH_SIZE];
+    char slaveName[PATH_SIZE];
+    int master;
+    int slave;
+    int backlogs; // Directions with bytes waiting for the port to take them
+} CablePort;
+
+// One direction of a link, with the counters of the statistics dump
+typedef struct
+{
+    char name[32];
+    int id;   // Index of the direction in the capture
+    int link; // Link whose mode applies
+    int port; // Port the bytes come from
+    int portOut; // Port they go to
+    int fdOut;
+    int fdTimer;
+    Channel channel;
+    Slice *queue; // Bytes on the line, allocated when the line has a rate or delay
+    Capture *capture; // NULL when not capturing
+    int queueHead;
+    int queueCount;
+    unsigned char *backlog; // Ring of OUTPUT_BACKLOG bytes the port did not take yet, allocated on first use
+    int backlogHead;
+    int backlogCount;
+    unsigned long long chunks;
+    unsigned long long bytes;
+    unsigned long long dropped;
+    unsigned long long overruns; // Of the dropped bytes, those beyond the backlog
+    unsigned long long bitErrors;
+    double firstForward; // Time of the first byte delivered since the last schedule event, -1 if none
+    double lastActivity; // Time of the last byte received
+} CableDirection;
+
+// Counters of the time between two schedule events, summed over the links
+// (index 0 = from the transmitters, 1 = from the receivers)
+typedef struct
+{
+    double time;
+    const ScheduleEvent *event; // NULL for the segment before the first event
+    unsigned long long bytes[2];
+    unsigned long long dropped[2];
+    unsigned long long bitErrors[2];
+    double firstForward[2]; // Until every link delivered a byte
+} ScheduleSegment;
+
+// Runtime state of a fault schedule
+typedef struct
+{
+    Schedule schedule;
+    int fdTimer;
+    int next;     // Next event to apply
+    double start; // Time of the first byte, 0 = not started
+    CableMode savedModes[SCHEDULE_MAX_EVENTS][MAX_LINKS];
+    ChannelParams *savedParams; // Per event and direction
+    ScheduleSegment segments[SCHEDULE_MAX_EVENTS + 1];
+    int segmentCount;
+} ScheduleRun;
+
+// The links of the cable and their state
+typedef struct
+{
+    CablePort ports[MAX_PORTS];
+    int portCount;
+    CableDirection dirs[MAX_DIRECTIONS];
+    int dirCount;
+    CableMode modes[MAX_LINKS];
+    int linkCount;
+    int broadcast;
+    int verbose;
+} Cable;
+
+// Epoll events: port p uses EventPort + p, the timer of direction d EventPort + MAX_PORTS + d
+enum
+{
+    EventStdin = 1,
+    EventSignal,
+    EventSchedule,
+    EventPort,
+};
+
+const char *cableModeNames[] = {"on", "off", "noise"};
+
+int fdEpoll = -1;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void countForwarded(CableDirection *dir, int n)
+{
+    if (n > 0 && dir->firstForward < 0)
+        dir->firstForward = now();
+    dir->bytes += n;
+}
+
+// Watch the port for room (EPOLLOUT) while any direction has a backlog for it.
+void watchOutput(CablePort *ports, CableDirection *dir, int waiting)
+{
+    CablePort *port = &ports[dir->portOut];
+    port->backlogs += waiting ? 1 : -1;
+    if (port->backlogs != (waiting ? 1 : 0))
+        return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | (waiting ? EPOLLOUT : 0);
+    event.data.u64 = EventPort + dir->portOut;
+    epoll_ctl(fdEpoll, EPOLL_CTL_MOD, port->master, &event);
+}
+
+// Write as much of the backlog as the port takes.
+void flushBacklog(CablePort *ports, CableDirection *dir)
+{
+    if (dir->backlogCount == 0)
+        return;
+
+    while (dir->backlogCount > 0)
+    {
+        int size = OUTPUT_BACKLOG - dir->backlogHead;
+        size = dir->backlogCount < size ? dir->backlogCount : size;
+        int w = write(dir->fdOut, dir->backlog + dir->backlogHead, size);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && errno == EAGAIN)
+            break;
+        if (w <= 0)
+        {
+            // The port went away, what it held is lost
+            dir->dropped += dir->backlogCount;
+            dir->backlogCount = 0;
+            break;
+        }
+        countForwarded(dir, w);
+        dir->backlogHead = (dir->backlogHead + w) % OUTPUT_BACKLOG;
+        dir->backlogCount -= w;
+    }
+
+    if (dir->backlogCount == 0)
+        watchOutput(ports, dir, FALSE);
+}
+
+// Write to the other side of the cable. What the port cannot take yet waits in
+// the backlog of the direction until it has room again, only bytes beyond
+// OUTPUT_BACKLOG are dropped, like a real overrun. While another direction has
+// bytes waiting for the same port (broadcast replies), these wait their turn too.
+void writeOut(CablePort *ports, CableDirection *dir, const unsigned char *buf, int n)
+{
+    int written = 0;
+    while (ports[dir->portOut].backlogs == 0 && written < n)
+    {
+        int w = write(dir->fdOut, buf + written, n - written);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && errno == EAGAIN)
+            break;
+        if (w <= 0)
+        {
+            dir->dropped += n - written;
+            return;
+        }
+        written += w;
+    }
+    countForwarded(dir, written);
+    if (written == n)
+        return;
+
+    if (dir->backlog == NULL && (dir->backlog = (unsigned char *)malloc(OUTPUT_BACKLOG)) == NULL)
+    {
+        dir->dropped += n - written;
+        return;
+    }
+
+    int wasEmpty = dir->backlogCount == 0;
+    for (; written < n && dir->backlogCount < OUTPUT_BACKLOG; written++, dir->backlogCount++)
+        dir->backlog[(dir->backlogHead + dir->backlogCount) % OUTPUT_BACKLOG] = buf[written];
+    dir->dropped += n - written;
+    dir->overruns += n - written;
+
+    if (wasEmpty)
+        watchOutput(ports, dir, TRUE);
+}
+
+// Deliver the slices that reached the other end and arm the timer for the next one.
+void release(CablePort *ports, CableDirection *dir)
+{
+    double t = now();
+
+    while (dir->queueCount > 0 && dir->queue[dir->queueHead].arrival <= t)
+    {
+        Slice *slice = &dir->queue[dir->queueHead];
+        writeOut(ports, dir, slice->data, slice->size);
+        dir->queueHead = (dir->queueHead + 1) % QUEUE_SLICES;
+        dir->queueCount--;
+    }
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (dir->queueCount > 0)
+    {
+        double arrival = dir->queue[dir->queueHead].arrival;
+        spec.it_value.tv_sec = (time_t)arrival;
+        spec.it_value.tv_nsec = (long)((arrival - (time_t)arrival) * 1e9);
+    }
+    timerfd_settime(dir->fdTimer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Put bytes on the line: they arrive after their transmission time at the
+// line rate (start and stop bits included) plus the propagation delay.
+void transmit(CablePort *ports, CableDirection *dir, const unsigned char *buf, int n)
+{
+    if (dir->queue == NULL)
+    {
+        writeOut(ports, dir, buf, n);
+        return;
+    }
+
+    double t = now();
+    for (int offset = 0; offset < n; offset += SLICE_SIZE)
+    {
+        int size = n - offset < SLICE_SIZE ? n - offset : SLICE_SIZE;
+        double arrival = channelSchedule(&dir->channel, size, t);
+
+        if (dir->queueCount == QUEUE_SLICES)
+        {
+            dir->dropped += size;
+            continue;
+        }
+
+        Slice *slice = &dir->queue[(dir->queueHead + dir->queueCount) % QUEUE_SLICES];
+        slice->arrival = arrival;
+        slice->size = size;
+        memcpy(slice->data, buf + offset, size);
+        dir->queueCount++;
+    }
+
+    release(ports, dir);
+}
+
+// Carry one chunk read from the direction's port to the other end.
+void deliver(Cable *cable, CableDirection *dir, unsigned char *buf, int n)
+{
+    CableMode mode = cable->modes[dir->link];
+
+    dir->chunks++;
+    dir->lastActivity = now();
+
+    if (mode == CableModeOff)
+    {
+        if (dir->capture != NULL)
+            captureChunk(dir->capture, dir->id, mode, CAPTURE_DROPPED, buf, n);
+        dir->dropped += n;
+        if (cable->verbose)
+            printf("%s: %d bytes, CONNECTION OFF\n", dir->name, n);
+        return;
+    }
+
+    unsigned long bitErrors = 0;
+    if (mode == CableModeNoise)
+    {
+        bitErrors = channelCorrupt(&dir->channel, buf, n);
+        dir->bitErrors += bitErrors;
+    }
+
+    if (dir->capture != NULL)
+        captureChunk(dir->capture, dir->id, mode, bitErrors > 0 ? CAPTURE_NOISE : 0, buf, n);
+
+    transmit(cable->ports, dir, buf, n);
+
+    if (cable->verbose)
+        printf("%s: %d bytes, %lu bit errors\n", dir->name, n, bitErrors);
+}
+
+// Move everything available on one port to the directions it feeds
+// (one, or every receiver when a transmitter broadcasts).
+void forward(Cable *cable, int port)
+{
+    unsigned char buf[BUF_SIZE];
+    unsigned char copy[BUF_SIZE];
+
+    while (TRUE)
+    {
+        int n = read(cable->ports[port].master, buf, BUF_SIZE);
+        if (n <= 0)
+            break;
+
+        for (int d = 0; d < cable->dirCount; d++)
+        {
+            CableDirection *dir = &cable->dirs[d];
+            if (dir->port != port)
+                continue;
+
+            // Each direction corrupts its own copy
+            memcpy(copy, buf, n);
+            deliver(cable, dir, copy, n);
+        }
+    }
+}
+
+void printCounters(const Cable *cable)
+{
+    for (int l = 0; l < cable->linkCount; l++)
+    {
+        if (cable->linkCount == 1)
+            printf("Cable %s\n", cableModeNames[cable->modes[l]]);
+        else
+            printf("Link %d %s\n", l, cableModeNames[cable->modes[l]]);
+
+        for (int d = 2 * l; d < 2 * l + 2; d++)
+        {
+            const CableDirection *dir = &cable->dirs[d];
+            printf("  %s: %llu chunks, %llu bytes forwarded, %llu dropped (%llu overrun), %llu bit errors\n",
+                   dir->name, dir->chunks, dir->bytes, dir->dropped, dir->overruns, dir->bitErrors);
+        }
+    }
+    fflush(stdout);
+}
+
+// Set the mode of one link, or of all of them when link is -1.
+void setMode(Cable *cable, int link, CableMode mode)
+{
+    for (int l = 0; l < cable->linkCount; l++)
+    {
+        if (link == -1 || link == l)
+            cable->modes[l] = mode;
+    }
+}
+
+// Apply one console command ("off", "on" or "noise", optionally followed by a
+// link number). Return TRUE if the program must end.
+int handleCommand(const char *command, Cable *cable)
+{
+    char word[16] = "";
+    int link = -1;
+    if (sscanf(command, "%15s %d", word, &link) < 1)
+        return FALSE;
+
+    if (link < -1 || link >= cable->linkCount)
+    {
+        printf("No link %d\n", link);
+    }
+    else if (strcmp(word, "off") == 0 || strcmp(word, "0") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        setMode(cable, link, CableModeOff);
+    }
+    else if (strcmp(word, "on") == 0 || strcmp(word, "1") == 0)
+    {
+        printf("CONNECTION ON\n");
+        setMode(cable, link, CableModeOn);
+    }
+    else if (strcmp(word, "noise") == 0 || strcmp(word, "2") == 0)
+    {
+        printf("CONNECTION NOISE\n");
+        setMode(cable, link, CableModeNoise);
+    }
+    else if (strcmp(word, "stats") == 0)
+    {
+        printCounters(cable);
+    }
+    else if (strcmp(word, "end") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        return TRUE;
+    }
+    fflush(stdout);
+    return FALSE;
+}
+
+// Apply a "[LINK:][tx.|rx.]key=value" parameter to the channels it selects.
+// Return "0" on success or "-1" if it is invalid.
+int setParam(ChannelParams *params, int dirCount, const char *param)
+{
+    int link = -1;
+    int side = -1;
+
+    const char *colon = strchr(param, ':');
+    if (colon != NULL)
+    {
+        char *end;
+        link = (int)strtol(param, &end, 10);
+        if (end != colon || link < 0 || 2 * link >= dirCount)
+            return -1;
+        param = colon + 1;
+    }
+
+    if (strncmp(param, "tx.", 3) == 0 || strncmp(param, "rx.", 3) == 0)
+    {
+        side = param[0] == 't' ? 0 : 1;
+        param += 3;
+    }
+
+    for (int d = 0; d < dirCount; d++)
+    {
+        if ((link != -1 && d / 2 != link) || (side != -1 && d % 2 != side))
+            continue;
+        if (channelParseParam(&params[d], param) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// Apply a parameter to a running cable.
+void applyParam(Cable *cable, const char *param)
+{
+    ChannelParams params[MAX_DIRECTIONS];
+    for (int d = 0; d < cable->dirCount; d++)
+        params[d] = cable->dirs[d].channel.params;
+
+    if (setParam(params, cable->dirCount, param) == -1)
+    {
+        printf("Invalid parameter %s\n", param);
+        return;
+    }
+
+    for (int d = 0; d < cable->dirCount; d++)
+    {
+        CableDirection *dir = &cable->dirs[d];
+        if (memcmp(&params[d], &dir->channel.params, sizeof(ChannelParams)) != 0)
+            channelSetParams(&dir->channel, &params[d]);
+
+        if ((params[d].baudRate > 0 || params[d].delay > 0) && dir->queue == NULL)
+            dir->queue = (Slice *)malloc(sizeof(Slice) * QUEUE_SLICES);
+    }
+}
+
+// Close the current schedule segment and open a new one.
+void startSegment(ScheduleRun *run, Cable *cable, const ScheduleEvent *event)
 {
-    int fd = open(serialPort, O_RDWR | O_NOCTTY);
+    double t = now();
+
+    if (run->segmentCount > 0)
+    {
+        ScheduleSegment *last = &run->segments[run->segmentCount - 1];
+        for (int side = 0; side < 2; side++)
+        {
+            unsigned long long bytes = 0, dropped = 0, bitErrors = 0;
+            double firstForward = 0;
+
+            for (int d = side; d < cable->dirCount; d += 2)
+            {
+                const CableDirection *dir = &cable->dirs[d];
+                bytes += dir->bytes;
+                dropped += dir->dropped;
+                bitErrors += dir->bitErrors;
+                if (dir->firstForward < 0 || firstForward < 0)
+                    firstForward = -1;
+                else if (dir->firstForward - last->time > firstForward)
+                    firstForward = dir->firstForward - last->time;
+            }
+
+            last->bytes[side] = bytes - last->bytes[side];
+            last->dropped[side] = dropped - last->dropped[side];
+            last->bitErrors[side] = bitErrors - last->bitErrors[side];
+            last->firstForward[side] = firstForward;
+        }
+    }
+
+    if (event == NULL && run->segmentCount > 0)
+        return;
+
+    ScheduleSegment *segment = &run->segments[run->segmentCount++];
+    memset(segment, 0, sizeof(*segment));
+    segment->time = t;
+    segment->event = event;
+    for (int d = 0; d < cable->dirCount; d++)
+    {
+        CableDirection *dir = &cable->dirs[d];
+        segment->bytes[d % 2] += dir->bytes;
+        segment->dropped[d % 2] += dir->dropped;
+        segment->bitErrors[d % 2] += dir->bitErrors;
+        dir->firstForward = -1;
+    }
+}
+
+// Arm the schedule timer for the next event, or for the idle check after the last one.
+void armSchedule(ScheduleRun *run)
+{
+    double at = run->next < run->schedule.count ? run->start + run->schedule.events[run->next].time
+                                                : now() + 1;
+
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t)at;
+    spec.it_value.tv_nsec = (long)((at - (time_t)at) * 1e9);
+    timerfd_settime(run->fdTimer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Apply the events that are due. Return TRUE if the schedule is over.
+int runSchedule(ScheduleRun *run, Cable *cable)
+{
+    double t = now();
+
+    while (run->next < run->schedule.count && run->start + run->schedule.events[run->next].time <= t)
+    {
+        int index = run->next++;
+        const ScheduleEvent *event = &run->schedule.events[index];
+        ChannelParams *saved = &run->savedParams[index * cable->dirCount];
+
+        printf("t=%.3fs ", t - run->start);
+        if (event->link >= 0)
+            printf("%d:", event->link);
+        printf("%s", scheduleActionName(event->action));
+        for (int i = 0; i < event->paramCount; i++)
+            printf(" %s", event->params[i]);
+        printf("\n");
+        fflush(stdout);
+
+        if (event->action == ScheduleEnd)
+            return TRUE;
+
+        startSegment(run, cable, event);
+
+        if (event->action == ScheduleRestore)
+        {
+            // Only the links the event changed go back, others may have moved on
+            ChannelParams *restored = &run->savedParams[event->restores * cable->dirCount];
+            for (int d = 0; d < cable->dirCount; d++)
+            {
+                if (event->link != -1 && d / 2 != event->link)
+                    continue;
+                cable->modes[d / 2] = run->savedModes[event->restores][d / 2];
+                channelSetParams(&cable->dirs[d].channel, &restored[d]);
+            }
+            continue;
+        }
+
+        memcpy(run->savedModes[index], cable->modes, sizeof(cable->modes));
+        for (int d = 0; d < cable->dirCount; d++)
+            saved[d] = cable->dirs[d].channel.params;
+
+        for (int i = 0; i < event->paramCount; i++)
+            applyParam(cable, event->params[i]);
+        setMode(cable, event->link,
+                event->action == ScheduleOff     ? CableModeOff
+                : event->action == ScheduleNoise ? CableModeNoise
+                                                 : CableModeOn);
+    }
 
-    if (fd < 0)
-        return -1;
+    // Without an "end" event, stop once the transfers are over
+    if (run->next == run->schedule.count)
+    {
+        int idle = TRUE;
+        for (int d = 0; d < cable->dirCount; d++)
+        {
+            if (t - cable->dirs[d].lastActivity <= SCHEDULE_IDLE_EXIT)
+                idle = FALSE;
+        }
+        if (idle)
+            return TRUE;
+    }
 
-    // Save current port settings
-    if (tcgetattr(fd, oldtio) == -1)
-        return -1;
+    armSchedule(run);
+    return FALSE;
+}
 
-    memset(newtio, 0, sizeof(*newtio));
-    newtio->c_cflag = BAUDRATE | CS8 | CLOCAL | CREAD;
-    newtio->c_iflag = IGNPAR;
-    newtio->c_oflag = 0;
-    newtio->c_lflag = 0;
-    newtio->c_cc[VTIME] = 1; // Inter-character timer unused
-    newtio->c_cc[VMIN] = 0;  // Read without blocking
-    tcflush(fd, TCIOFLUSH);
+void printScheduleSummary(ScheduleRun *run, Cable *cable)
+{
+    startSegment(run, cable, NULL);
 
-    if (tcsetattr(fd, TCSANOW, newtio) == -1)
-        return -1;
+    printf("\nSchedule summary (first forwarded = time from the event to the first byte delivered%s)\n",
+           cable->linkCount > 1 ? " on every link" : "");
+    printf("%9s  %-8s | %10s %8s %6s %9s | %10s %8s %6s %9s\n", "time", "event",
+           "Tx>Rx fwd", "dropped", "errors", "first fwd", "Rx>Tx fwd", "dropped", "errors", "first fwd");
 
-    return fd;
+    for (int i = 0; i < run->segmentCount; i++)
+    {
+        ScheduleSegment *segment = &run->segments[i];
+        printf("%8.3fs  %-8s", segment->time - run->start,
+               segment->event == NULL ? "start" : scheduleActionName(segment->event->action));
+        for (int side = 0; side < 2; side++)
+        {
+            printf(" | %10llu %8llu %6llu ", segment->bytes[side], segment->dropped[side], segment->bitErrors[side]);
+            if (segment->firstForward[side] < 0)
+                printf("%9s", "-");
+            else
+                printf("%8.3fs", segment->firstForward[side]);
+        }
+        printf("\n");
+    }
+    fflush(stdout);
 }
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+// Parse the channel model arguments: "[LINK:][tx.|rx.]key=value" or "seed=N".
+// Unprefixed keys apply to every link and both directions (tx = from the
+// transmitter, rx = from the receiver).
+int parseChannelArgs(int argc, char *argv[], ChannelParams *params, int dirCount, unsigned long *seed)
 {
-    buf[errorIndex] ^= 0xFF;
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+
+        if (strcmp(arg, "-v") == 0 || strcmp(arg, "-b") == 0)
+            continue;
+
+        if (strcmp(arg, "-s") == 0 || strcmp(arg, "-d") == 0 || strcmp(arg, "-w") == 0 || strcmp(arg, "-n") == 0)
+        {
+            i++;
+            continue;
+        }
+
+        if (strncmp(arg, "seed=", 5) == 0)
+        {
+            *seed = strtoul(arg + 5, NULL, 0);
+            continue;
+        }
+
+        if (setParam(params, dirCount, arg) == -1)
+        {
+            printf("Invalid argument: %s\n"
+                   "Usage: %s [-v] [-s SCHEDULE] [-d DIR] [-w CAPTURE] [-n LINKS [-b]] [seed=N]\n"
+                   "          [[LINK:][tx.|rx.]ber=P] [[LINK:][tx.|rx.]burst=ENTER,LEAVE,BER]\n"
+                   "          [[LINK:][tx.|rx.]baud=BPS] [[LINK:][tx.|rx.]delay=SECONDS]\n"
+                   "          [[LINK:][tx.|rx.]bits=BITS_PER_BYTE]\n",
+                   arg, argv[0]);
+            return -1;
+        }
+    }
+
+    for (int d = 0; d < dirCount; d++)
+    {
+        if (params[d].ber == 0 && params[d].burstEnter == 0)
+            params[d].ber = DEFAULT_NOISE_BER;
+    }
+
+    return 0;
 }
 
 int main(int argc, char *argv[])
 {
-    printf("\n");
+    static Cable cable;
+    static ScheduleRun run;
+    const char *schedulePath = NULL;
+    const char *linkDir = NULL;
+    char defaultLinkDir[PATH_SIZE / 2]; // Leaves room for the port names
+    const char *capturePath = NULL;
+    Capture capture;
 
-    system("socat -dd PTY,link=/dev/ttyS2,mode=777 PTY,link=/dev/emulatorTx,mode=777 &");
-    sleep(1);
-    printf("\n");
+    cable.linkCount = 1;
 
-    system("socat -dd PTY,link=/dev/ttyS2,mode=777 PTY,link=/dev/emulatorRx,mode=777 &");
-    sleep(1);
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+            cable.verbose = TRUE;
+        else if (strcmp(argv[i], "-b") == 0)
+            cable.broadcast = TRUE;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            schedulePath = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            linkDir = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            capturePath = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            cable.linkCount = atoi(argv[++i]);
+    }
 
-    printf("\n\n"
-           "Transmitter must open /dev/ttyS10\n"
-           "Receiver must open /dev/ttyS11\n"
-           "\n"
+    if (linkDir == NULL)
+    {
+        const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+        if (runtimeDir != NULL && runtimeDir[0] != '\0')
+            snprintf(defaultLinkDir, sizeof(defaultLinkDir), "%s/%s", runtimeDir, DEFAULT_LINK_DIR);
+        else
+            snprintf(defaultLinkDir, sizeof(defaultLinkDir), FALLBACK_LINK_DIR, (unsigned)getuid());
+        linkDir = defaultLinkDir;
+    }
+
+    // Removed again at the end if this cable created it
+    int madeLinkDir = mkdir(linkDir, 0700) == 0;
+    if (!madeLinkDir && errno != EEXIST)
+    {
+        perror(linkDir);
+        exit(1);
+    }
+
+    if (cable.linkCount < 1 || cable.linkCount > MAX_LINKS)
+    {
+        printf("The number of links must be between 1 and %d\n", MAX_LINKS);
+        exit(1);
+    }
+
+    // Point to point: link k joins ports 2k and 2k + 1.
+    // Broadcast: port 0 is the transmitter of every link, link k ends at port k + 1.
+    cable.dirCount = 2 * cable.linkCount;
+    cable.portCount = cable.broadcast ? cable.linkCount + 1 : cable.dirCount;
+
+    // Error model of the "noise" mode, one channel per direction
+    ChannelParams params[MAX_DIRECTIONS];
+    memset(params, 0, sizeof(params));
+    unsigned long seed = 1;
+
+    if (parseChannelArgs(argc, argv, params, cable.dirCount, &seed) == -1)
+        exit(1);
+
+    if (schedulePath != NULL && scheduleLoad(&run.schedule, schedulePath) == -1)
+        exit(1);
+
+    for (int p = 0; p < cable.portCount; p++)
+    {
+        CablePort *port = &cable.ports[p];
+        snprintf(port->link, PATH_SIZE, "%s/ttyS%d", linkDir, FIRST_PORT + p);
+
+        if (ptyOpen(&port->master, &port->slave, port->slaveName, PATH_SIZE) == -1)
+        {
+            perror("openpty");
+            exit(-1);
+        }
+
+        // Reads are driven by epoll, they must never block
+        fcntl(port->master, F_SETFL, fcntl(port->master, F_GETFL) | O_NONBLOCK);
+
+        if (ptyLink(port->slaveName, port->link) == -1)
+        {
+            perror(port->link);
+            exit(-1);
+        }
+    }
+
+    for (int d = 0; d < cable.dirCount; d++)
+    {
+        CableDirection *dir = &cable.dirs[d];
+        int link = d / 2;
+        int txPort = cable.broadcast ? 0 : 2 * link;
+        int rxPort = cable.broadcast ? link + 1 : 2 * link + 1;
+
+        if (cable.linkCount == 1)
+            snprintf(dir->name, sizeof(dir->name), d % 2 == 0 ? "Tx > Rx" : "Rx > Tx");
+        else
+            snprintf(dir->name, sizeof(dir->name), d % 2 == 0 ? "Link %d Tx > Rx" : "Link %d Rx > Tx", link);
+
+        dir->id = d;
+        dir->link = link;
+        dir->port = d % 2 == 0 ? txPort : rxPort;
+        dir->portOut = d % 2 == 0 ? rxPort : txPort;
+        dir->fdOut = cable.ports[dir->portOut].master;
+        dir->firstForward = -1;
+        channelInit(&dir->channel, &params[d], seed + d);
+    }
+
+    printf("\n");
+    if (cable.broadcast)
+    {
+        printf("Transmitter must open %s (%s)\n", cable.ports[0].link, cable.ports[0].slaveName);
+        for (int p = 1; p < cable.portCount; p++)
+            printf("Receiver %d must open %s (%s)\n", p - 1, cable.ports[p].link, cable.ports[p].slaveName);
+    }
+    else
+    {
+        for (int l = 0; l < cable.linkCount; l++)
+        {
+            const CablePort *tx = &cable.ports[2 * l];
+            const CablePort *rx = &cable.ports[2 * l + 1];
+            if (cable.linkCount > 1)
+                printf("Link %d: ", l);
+            printf("Transmitter must open %s (%s)\n", tx->link, tx->slaveName);
+            if (cable.linkCount > 1)
+                printf("Link %d: ", l);
+            printf("Receiver must open %s (%s)\n", rx->link, rx->slaveName);
+        }
+    }
+
+    printf("\n"
            "The cable program is sensible to the following interactive commands:\n"
-           "--- on           : connect the cable and data is exchanged (default state)\n"
-           "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- noise        : add fixed noise to the cable\n"
-           "--- end          : terminate the program\n"
+           "--- on [LINK]    : connect the cable and data is exchanged (default state)\n"
+           "--- off [LINK]   : disconnect the cable disabling data to be exchanged\n"
+           "--- noise [LINK] : add noise to the cable (seeded bit errors)\n"
+           "--- stats        : print the counters of every direction (also on SIGUSR1)\n"
+           "--- end          : terminate the program (also on SIGINT / SIGTERM)\n"
            "\n");
 
-    // Configure serial ports
-    struct termios oldtioTx;
-    struct termios newtioTx;
-
-    int fdTx = openSerialPort("/dev/emulatorTx", &oldtioTx, &newtioTx);
+    if (capturePath != NULL)
+    {
+        if (captureOpen(&capture, capturePath, cable.dirCount) == -1)
+        {
+            perror(capturePath);
+            exit(-1);
+        }
+        for (int d = 0; d < cable.dirCount; d++)
+            cable.dirs[d].capture = &capture;
+        printf("Capturing the wire to %s\n", capturePath);
+    }
 
-    if (fdTx < 0)
+    // A line with a rate or a delay holds the bytes in flight until they arrive
+    for (int d = 0; d < cable.dirCount; d++)
     {
-        perror("Opening Tx emulator serial port");
-        exit(-1);
+        CableDirection *dir = &cable.dirs[d];
+        dir->fdTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        if (dir->channel.params.baudRate > 0 || dir->channel.params.delay > 0)
+        {
+            dir->queue = (Slice *)malloc(sizeof(Slice) * QUEUE_SLICES);
+            printf("%s: %d bps, %d bits per byte, %g s propagation delay\n", dir->name,
+                   dir->channel.params.baudRate, dir->channel.params.bitsPerByte, dir->channel.params.delay);
+        }
     }
 
-    struct termios oldtioRx;
-    struct termios newtioRx;
+    // SIGUSR1 dumps the counters without touching the console input;
+    // SIGINT and SIGTERM stop the cable cleanly so its links are removed
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int fdSignal = signalfd(-1, &signals, SFD_NONBLOCK);
 
-    int fdRx = openSerialPort("/dev/emulatorRx", &oldtioRx, &newtioRx);
+    // Every source wakes up the loop as soon as it has data, no polling interval
+    fdEpoll = epoll_create1(0);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
 
-    if (fdRx < 0)
+    for (int p = 0; p < cable.portCount; p++)
+    {
+        event.data.u64 = EventPort + p;
+        epoll_ctl(fdEpoll, EPOLL_CTL_ADD, cable.ports[p].master, &event);
+    }
+    for (int d = 0; d < cable.dirCount; d++)
     {
-        perror("Opening Rx emulator serial port");
-        exit(-1);
+        event.data.u64 = EventPort + MAX_PORTS + d;
+        epoll_ctl(fdEpoll, EPOLL_CTL_ADD, cable.dirs[d].fdTimer, &event);
     }
+    event.data.u64 = EventSignal;
+    epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fdSignal, &event);
 
-    // Configure stdin to receive commands to this program
-    int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
+    // A schedule replaces the console: it starts with the first byte on the line
+    if (schedulePath != NULL)
+    {
+        run.savedParams = (ChannelParams *)malloc(sizeof(ChannelParams) * (run.schedule.count + 1) * cable.dirCount);
+        run.fdTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        event.data.u64 = EventSchedule;
+        epoll_ctl(fdEpoll, EPOLL_CTL_ADD, run.fdTimer, &event);
+        printf("Running schedule %s (%d events), console commands are ignored\n", schedulePath, run.schedule.count);
+    }
+    else
+    {
+        event.data.u64 = EventStdin;
+        epoll_ctl(fdEpoll, EPOLL_CTL_ADD, STDIN_FILENO, &event);
+    }
 
-    unsigned char tx2rx[BUF_SIZE] = {0};
-    unsigned char rx2tx[BUF_SIZE] = {0};
     char rxStdin[BUF_SIZE] = {0};
 
-    CableMode cableMode = CableModeOn;
     volatile int STOP = FALSE;
 
     printf("Cable ready\n");
+    fflush(stdout);
 
     while (STOP == FALSE)
     {
-        // Read from Tx
-        int bytesFromTx = read(fdTx, tx2rx, BUF_SIZE);
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(fdEpoll, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
 
-        if (bytesFromTx > 0)
+        for (int i = 0; i < n; i++)
         {
-            if (cableMode == CableModeOff)
+            if (events[i].data.u64 == EventSignal)
             {
-                printf("bytesFromTx=%d > bytesToRx=CONNECTION OFF\n", bytesFromTx);
-            }
-            else
-            {
-                if (cableMode == CableModeNoise)
+                struct signalfd_siginfo info;
+                while (read(fdSignal, &info, sizeof(info)) == sizeof(info))
                 {
-                    addNoiseToBuffer(tx2rx, 0);
+                    if (info.ssi_signo == SIGUSR1)
+                        printCounters(&cable);
+                    else
+                        STOP = TRUE;
                 }
-
-                int bytesToRx = write(fdRx, tx2rx, bytesFromTx);
-                printf("bytesFromTx=%d > bytesToRx=%d\n", bytesFromTx, bytesToRx);
+                continue;
             }
-        }
 
-        // Read from Rx
-        int bytesFromRx = read(fdRx, rx2tx, BUF_SIZE);
-
-        if (bytesFromRx > 0)
-        {
-            if (cableMode == CableModeOff)
+            if (events[i].data.u64 >= EventPort + MAX_PORTS)
             {
-                printf("bytesToTx=CONNECTION OFF < bytesFromRx=%d\n", bytesFromRx);
+                CableDirection *dir = &cable.dirs[events[i].data.u64 - EventPort - MAX_PORTS];
+                unsigned long long expirations;
+                if (read(dir->fdTimer, &expirations, sizeof(expirations)) > 0)
+                    release(cable.ports, dir);
+                continue;
             }
-            else
+
+            if (events[i].data.u64 >= EventPort)
             {
-                if (cableMode == CableModeNoise)
+                int port = events[i].data.u64 - EventPort;
+
+                // Room again for the directions that write to the port
+                if (events[i].events & EPOLLOUT)
                 {
-                    addNoiseToBuffer(rx2tx, 0);
+                    for (int d = 0; d < cable.dirCount; d++)
+                    {
+                        if (cable.dirs[d].portOut == port)
+                            flushBacklog(cable.ports, &cable.dirs[d]);
+                    }
+                    if (events[i].events == EPOLLOUT)
+                        continue;
                 }
 
-                int bytesToTx = write(fdTx, rx2tx, bytesFromRx);
-                printf("bytesToTx=%d < bytesFromRx=%d\n", bytesToTx, bytesFromRx);
-            }
-        }
-
-        // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
-        {
-            rxStdin[fromStdin - 1] = '\0';
+                forward(&cable, port);
 
-            if (strcmp(rxStdin, "off") == 0 || strcmp(rxStdin, "0") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                cableMode = CableModeOff;
+                if (schedulePath != NULL && run.start == 0)
+                {
+                    run.start = now();
+                    startSegment(&run, &cable, NULL);
+                    if (runSchedule(&run, &cable))
+                        STOP = TRUE;
+                }
+                continue;
             }
-            else if (strcmp(rxStdin, "on") == 0 || strcmp(rxStdin, "1") == 0)
+
+            if (events[i].data.u64 == EventSchedule)
             {
-                printf("CONNECTION ON\n");
-                cableMode = CableModeOn;
+                unsigned long long expirations;
+                if (read(run.fdTimer, &expirations, sizeof(expirations)) > 0 && runSchedule(&run, &cable))
+                    STOP = TRUE;
+                continue;
             }
-            else if (strcmp(rxStdin, "noise") == 0 || strcmp(rxStdin, "2") == 0)
+
+            // Read commands from STDIN to control the cable mode
+            int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE - 1);
+            if (fromStdin <= 0)
             {
-                printf("CONNECTION NOISE\n");
-                cableMode = CableModeNoise;
+                // Console closed, keep forwarding without it
+                epoll_ctl(fdEpoll, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                continue;
             }
-            else if (strcmp(rxStdin, "end") == 0)
+
+            rxStdin[fromStdin] = '\0';
+
+            // Several commands may arrive in one read when stdin is a pipe
+            for (char *command = strtok(rxStdin, "\n"); command != NULL; command = strtok(NULL, "\n"))
             {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
+                if (handleCommand(command, &cable))
+                    STOP = TRUE;
             }
+            fflush(stdout);
         }
     }
 
-    // Restore the old port settings
-    if (tcsetattr(fdRx, TCSANOW, &oldtioRx) == -1)
+    for (int p = 0; p < cable.portCount; p++)
     {
-        perror("tcsetattr");
-        exit(-1);
+        ptyUnlink(cable.ports[p].slaveName, cable.ports[p].link);
+        close(cable.ports[p].master);
+        close(cable.ports[p].slave);
     }
-
-    if (tcsetattr(fdTx, TCSANOW, &oldtioTx) == -1)
+    if (madeLinkDir)
+        rmdir(linkDir);
+    close(fdEpoll);
+    close(fdSignal);
+    for (int d = 0; d < cable.dirCount; d++)
     {
-        perror("tcsetattr");
-        exit(-1);
+        close(cable.dirs[d].fdTimer);
+        free(cable.dirs[d].queue);
+        free(cable.dirs[d].backlog);
     }
 
-    close(fdTx);
-    close(fdRx);
+    printCounters(&cable);
 
-    system("killall socat");
+    if (capturePath != NULL)
+    {
+        if (captureClose(&capture) == -1)
+            perror(capturePath);
+        printf("Captured %llu chunks, %llu bytes\n", capture.records, capture.bytes);
+    }
+
+    if (schedulePath != NULL)
+    {
+        if (run.start > 0)
+            printScheduleSummary(&run, &cable);
+        close(run.fdTimer);
+        free(run.savedParams);
+    }
 
     return 0;
 }
@@ -0,0 +1,93 @@
+// Wire capture implementation.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "capture.h"
+
+static int64_t clockNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int flush(Capture *capture) {
+    size_t written = 0;
+    while (written < capture->used) {
+        ssize_t n = write(capture->fd, capture->buffer + written, capture->used - written);
+        if (n <= 0)
+            return -1;
+        written += n;
+    }
+    capture->used = 0;
+    return 0;
+}
+
+static void append(Capture *capture, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+
+    while (size > 0) {
+        if (capture->used == CAPTURE_BUFFER_SIZE && flush(capture) == -1) {
+            perror("Writing capture");
+            capture->used = 0;
+        }
+
+        size_t n = CAPTURE_BUFFER_SIZE - capture->used;
+        if (n > size)
+            n = size;
+        memcpy(capture->buffer + capture->used, bytes, n);
+        capture->used += n;
+        bytes += n;
+        size -= n;
+    }
+}
+
+int captureOpen(Capture *capture, const char *path, int directions)
+{
+    memset(capture, 0, sizeof(*capture));
+
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (capture->fd == -1)
+        return -1;
+    capture->buffer = (unsigned char *)malloc(CAPTURE_BUFFER_SIZE);
+
+    CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CAPTURE_MAGIC;
+    header.version = CAPTURE_VERSION;
+    header.directions = directions;
+    header.realtimeOffset = clockNs(CLOCK_REALTIME) - clockNs(CLOCK_MONOTONIC);
+    append(capture, &header, sizeof(header));
+
+    return 0;
+}
+
+void captureChunk(Capture *capture, int direction, int mode, int flags, const unsigned char *buf, size_t size)
+{
+    CaptureRecord record;
+    memset(&record, 0, sizeof(record));
+    record.timestamp = clockNs(CLOCK_MONOTONIC);
+    record.size = size;
+    record.direction = direction;
+    record.mode = mode;
+    record.flags = flags;
+
+    append(capture, &record, sizeof(record));
+    append(capture, buf, size);
+
+    capture->records++;
+    capture->bytes += size;
+}
+
+int captureClose(Capture *capture)
+{
+    int result = flush(capture);
+    if (close(capture->fd) == -1)
+        result = -1;
+    free(capture->buffer);
+    capture->buffer = NULL;
+    return result;
+}
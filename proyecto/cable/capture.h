@@ -0,0 +1,59 @@
+// Wire capture header.
+// Every chunk the cable reads is appended to a binary file: a CaptureHeader,
+// then one CaptureRecord followed by the chunk bytes (as delivered, after the
+// noise) per chunk. Fields are in host byte order. tools/capture2pcap.c turns
+// a capture into a pcap file.
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC 0x50414357 // "WCAP"
+#define CAPTURE_VERSION 1
+
+// Records are collected in memory and written in blocks of this size,
+// so capturing does not add a system call per chunk
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+// CaptureRecord flags
+#define CAPTURE_NOISE 0x01   // Bits were flipped in this chunk
+#define CAPTURE_DROPPED 0x02 // The cable was off, the chunk never reached the other end
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t directions;    // Number of directions (2 per pair of ports)
+    int64_t realtimeOffset; // CLOCK_REALTIME - CLOCK_MONOTONIC when the capture started, in ns
+} CaptureHeader;
+
+typedef struct
+{
+    uint64_t timestamp; // CLOCK_MONOTONIC when the cable read the chunk, in ns
+    uint32_t size;      // Bytes following the record
+    uint16_t direction; // Even = from a transmitter, odd = from a receiver
+    uint8_t mode;       // Cable mode: 0 = on, 1 = off, 2 = noise
+    uint8_t flags;
+} CaptureRecord;
+
+typedef struct
+{
+    int fd;
+    unsigned char *buffer;
+    size_t used;
+    unsigned long long records;
+    unsigned long long bytes;
+} Capture;
+
+// Create the capture file. Return "0" on success or "-1" on error.
+int captureOpen(Capture *capture, const char *path, int directions);
+
+// Append one chunk.
+void captureChunk(Capture *capture, int direction, int mode, int flags, const unsigned char *buf, size_t size);
+
+// Write the buffered records and close the file. Return "0" on success or "-1" on error.
+int captureClose(Capture *capture);
+
+#endif // _CAPTURE_H_
@@ -0,0 +1,157 @@
+// Channel emulator implementation.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "channel.h"
+
+#define NEVER UINT64_MAX
+
+// splitmix64, used to seed xorshift
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// xorshift64*
+static uint64_t nextRandom(Channel *channel) {
+    uint64_t x = channel->random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    channel->random = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform number in (0, 1]
+static double uniform(Channel *channel) {
+    return ((nextRandom(channel) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+// Number of failures before the first success of a Bernoulli(p) process
+static uint64_t geometric(Channel *channel, double p) {
+    if (p <= 0)
+        return NEVER;
+    if (p >= 1)
+        return 0;
+
+    double skip = floor(log(uniform(channel)) / log1p(-p));
+    if (skip >= 1.8e19)
+        return NEVER;
+    return (uint64_t)skip;
+}
+
+static double currentBer(const Channel *channel) {
+    return channel->bad ? channel->params.burstBer : channel->params.ber;
+}
+
+static void sampleState(Channel *channel) {
+    if (channel->params.burstEnter <= 0) {
+        channel->bad = 0;
+        channel->stateSkip = NEVER;
+        return;
+    }
+    double leave = channel->bad ? channel->params.burstLeave : channel->params.burstEnter;
+    uint64_t skip = geometric(channel, leave);
+    channel->stateSkip = skip == NEVER ? NEVER : skip + 1;
+}
+
+void channelInit(Channel *channel, const ChannelParams *params, uint64_t seed)
+{
+    memset(channel, 0, sizeof(*channel));
+    channel->random = mix(seed) | 1;
+    channelSetParams(channel, params);
+}
+
+void channelSetParams(Channel *channel, const ChannelParams *params)
+{
+    channel->params = *params;
+    if (channel->params.bitsPerByte <= 0)
+        channel->params.bitsPerByte = CHANNEL_BITS_PER_BYTE;
+
+    // Both processes are memoryless, so they can be restarted at any bit
+    sampleState(channel);
+    channel->errorSkip = geometric(channel, currentBer(channel));
+}
+
+unsigned long channelCorrupt(Channel *channel, unsigned char *buf, size_t size)
+{
+    uint64_t bit = 0;
+    uint64_t total = (uint64_t)size * 8;
+    unsigned long errors = 0;
+
+    channel->bytes += size;
+
+    while (bit < total) {
+        uint64_t step = channel->errorSkip < channel->stateSkip ? channel->errorSkip : channel->stateSkip;
+        if (step > total - bit)
+            step = total - bit;
+
+        bit += step;
+        if (channel->errorSkip != NEVER)
+            channel->errorSkip -= step;
+        if (channel->stateSkip != NEVER)
+            channel->stateSkip -= step;
+        if (bit == total)
+            break;
+
+        // Burst starts or ends before this bit: the error process restarts with the new rate
+        if (channel->stateSkip == 0) {
+            channel->bad = !channel->bad;
+            sampleState(channel);
+            channel->errorSkip = geometric(channel, currentBer(channel));
+            continue;
+        }
+
+        // Error at this bit
+        buf[bit / 8] ^= 1 << (bit % 8);
+        errors++;
+        bit++;
+        if (channel->stateSkip != NEVER)
+            channel->stateSkip--;
+        channel->errorSkip = geometric(channel, currentBer(channel));
+    }
+
+    channel->bitErrors += errors;
+    return errors;
+}
+
+double channelSchedule(Channel *channel, size_t size, double now)
+{
+    if (channel->lineFree < now)
+        channel->lineFree = now;
+    if (channel->params.baudRate > 0)
+        channel->lineFree += (double)size * channel->params.bitsPerByte / channel->params.baudRate;
+    return channel->lineFree + channel->params.delay;
+}
+
+int channelParseParam(ChannelParams *params, const char *text)
+{
+    const char *value = strchr(text, '=');
+    if (value == NULL)
+        return -1;
+    size_t keyLength = value - text;
+    value++;
+
+    char *end;
+    if (keyLength == 3 && strncmp(text, "ber", 3) == 0) {
+        params->ber = strtod(value, &end);
+    } else if (keyLength == 5 && strncmp(text, "delay", 5) == 0) {
+        params->delay = strtod(value, &end);
+    } else if (keyLength == 4 && strncmp(text, "baud", 4) == 0) {
+        params->baudRate = (int)strtol(value, &end, 10);
+    } else if (keyLength == 4 && strncmp(text, "bits", 4) == 0) {
+        params->bitsPerByte = (int)strtol(value, &end, 10);
+    } else if (keyLength == 5 && strncmp(text, "burst", 5) == 0) {
+        if (sscanf(value, "%lf,%lf,%lf", &params->burstEnter, &params->burstLeave, &params->burstBer) != 3)
+            return -1;
+        return 0;
+    } else {
+        return -1;
+    }
+
+    return *value != '\0' && *end == '\0' ? 0 : -1;
+}
@@ -0,0 +1,55 @@
+// Channel emulator header.
+// Deterministic model of one direction of a serial line: independent and
+// burst (Gilbert-Elliott) bit errors, line rate and propagation delay.
+// Every random decision comes from a seeded PRNG and is made per bit of the
+// byte stream, so results do not depend on how reads happen to be chunked.
+
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHANNEL_BITS_PER_BYTE 10 // 8N1: start bit, 8 data bits, stop bit
+
+typedef struct
+{
+    double ber;         // Bit error rate (in the good state when bursts are enabled)
+    double burstEnter;  // Gilbert-Elliott: probability per bit of entering the bad state, 0 = no bursts
+    double burstLeave;  // Gilbert-Elliott: probability per bit of leaving the bad state
+    double burstBer;    // Gilbert-Elliott: bit error rate in the bad state
+    double delay;       // One-way propagation delay in seconds
+    int baudRate;       // Line rate in bits per second, 0 = unlimited
+    int bitsPerByte;    // Line bits per data byte, 0 = CHANNEL_BITS_PER_BYTE
+} ChannelParams;
+
+typedef struct
+{
+    ChannelParams params;
+    uint64_t random;
+    int bad;             // Gilbert-Elliott state
+    uint64_t errorSkip;  // Clean bits before the next error
+    uint64_t stateSkip;  // Bits before the next state change
+    double lineFree;     // Time at which the line finishes the bytes already scheduled
+    unsigned long long bytes;
+    unsigned long long bitErrors;
+} Channel;
+
+// Start a channel with the given model and seed.
+void channelInit(Channel *channel, const ChannelParams *params, uint64_t seed);
+
+// Change the model of a running channel, keeping its random state.
+void channelSetParams(Channel *channel, const ChannelParams *params);
+
+// Flip the bits of buf hit by errors. Return the number of bits flipped.
+unsigned long channelCorrupt(Channel *channel, unsigned char *buf, size_t size);
+
+// Schedule size bytes handed to the line at time now (seconds, any monotonic clock).
+// Return the time at which their last bit reaches the other end.
+double channelSchedule(Channel *channel, size_t size, double now);
+
+// Set one "key=value" parameter: ber, burst=enter,leave,ber, delay, baud, bits.
+// Return "0" on success or "-1" if the key or value is invalid.
+int channelParseParam(ChannelParams *params, const char *text);
+
+#endif // _CHANNEL_H_
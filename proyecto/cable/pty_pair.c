@@ -0,0 +1,48 @@
+// Pseudo-terminal pair implementation.
+
+#include <pty.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "pty_pair.h"
+
+int ptyOpen(int *master, int *slave, char *name, size_t nameSize)
+{
+    struct termios tio;
+    memset(&tio, 0, sizeof(tio));
+    cfmakeraw(&tio);
+
+    if (openpty(master, slave, NULL, &tio, NULL) == -1)
+        return -1;
+
+    if (ttyname_r(*slave, name, nameSize) != 0)
+    {
+        close(*master);
+        close(*slave);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ptyLink(const char *name, const char *link)
+{
+    // Like socat's link option: a stale link from a previous run is replaced
+    if (unlink(link) == -1 && access(link, F_OK) == 0)
+        return -1;
+    return symlink(name, link);
+}
+
+void ptyUnlink(const char *name, const char *link)
+{
+    char target[256];
+    ssize_t n = readlink(link, target, sizeof(target) - 1);
+    if (n < 0)
+        return;
+    target[n] = '\0';
+
+    // Another cable may have taken the link over in the meantime
+    if (strcmp(target, name) == 0)
+        unlink(link);
+}
@@ -0,0 +1,23 @@
+// Pseudo-terminal pair header.
+// The cable and the benchmark emulate serial ports with pty pairs: the
+// program keeps the master, and the protocol opens the slave like a real
+// serial port.
+
+#ifndef _PTY_PAIR_H_
+#define _PTY_PAIR_H_
+
+#include <stddef.h>
+
+// Open a raw pty pair. The slave stays open so the master never sees a hangup
+// while no program uses the port.
+// name receives the slave path. Return "0" on success or "-1" on error.
+int ptyOpen(int *master, int *slave, char *name, size_t nameSize);
+
+// Publish the slave path as the symlink "link", replacing whatever was there.
+// Return "0" on success or "-1" on error.
+int ptyLink(const char *name, const char *link);
+
+// Remove "link" if it still points to the slave path name.
+void ptyUnlink(const char *name, const char *link);
+
+#endif // _PTY_PAIR_H_
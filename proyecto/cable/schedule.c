@@ -0,0 +1,194 @@
+// Fault schedule implementation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "channel.h"
+#include "schedule.h"
+
+// Parse "2.5", "2.5s" or "2500ms" into seconds. Return "0" on success.
+static int parseTime(const char *text, double *seconds) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0)
+        return -1;
+    if (strcmp(end, "ms") == 0)
+        value /= 1000;
+    else if (*end != '\0' && strcmp(end, "s") != 0)
+        return -1;
+    *seconds = value;
+    return 0;
+}
+
+// A parameter is valid if the channel accepts it, with an optional link and direction
+static int validParam(const char *param) {
+    ChannelParams params;
+    memset(&params, 0, sizeof(params));
+    const char *colon = strchr(param, ':');
+    if (colon != NULL)
+        param = colon + 1;
+    if (strncmp(param, "tx.", 3) == 0 || strncmp(param, "rx.", 3) == 0)
+        param += 3;
+    return channelParseParam(&params, param) == 0;
+}
+
+static int addEvent(Schedule *schedule, const ScheduleEvent *event) {
+    if (schedule->count == SCHEDULE_MAX_EVENTS) {
+        fprintf(stderr, "Schedule: more than %d events\n", SCHEDULE_MAX_EVENTS);
+        return -1;
+    }
+    schedule->events[schedule->count++] = *event;
+    return 0;
+}
+
+// Parse one "t=T action [params] [for D]" entry
+static int parseEntry(Schedule *schedule, char *entry) {
+    ScheduleEvent event;
+    memset(&event, 0, sizeof(event));
+    event.restores = -1;
+    event.link = -1;
+
+    double duration = 0;
+    int tokens = 0;
+    char *saveptr;
+
+    for (char *token = strtok_r(entry, " \t\r", &saveptr); token != NULL; token = strtok_r(NULL, " \t\r", &saveptr)) {
+        tokens++;
+
+        if (tokens == 1) {
+            if (strncmp(token, "t=", 2) != 0 || parseTime(token + 2, &event.time) == -1) {
+                fprintf(stderr, "Schedule: expected t=TIME, got \"%s\"\n", token);
+                return -1;
+            }
+        } else if (tokens == 2) {
+            char *colon = strchr(token, ':');
+            if (colon != NULL) {
+                event.link = atoi(token);
+                token = colon + 1;
+            }
+
+            if (strcmp(token, "on") == 0)
+                event.action = ScheduleOn;
+            else if (strcmp(token, "off") == 0)
+                event.action = ScheduleOff;
+            else if (strcmp(token, "noise") == 0)
+                event.action = ScheduleNoise;
+            else if (strcmp(token, "end") == 0)
+                event.action = ScheduleEnd;
+            else {
+                fprintf(stderr, "Schedule: unknown mode \"%s\"\n", token);
+                return -1;
+            }
+        } else if (strcmp(token, "for") == 0) {
+            token = strtok_r(NULL, " \t\r", &saveptr);
+            if (token == NULL || parseTime(token, &duration) == -1 || duration <= 0) {
+                fprintf(stderr, "Schedule: invalid duration after \"for\"\n");
+                return -1;
+            }
+        } else {
+            if (!validParam(token) || strlen(token) >= SCHEDULE_PARAM_SIZE || event.paramCount == SCHEDULE_MAX_PARAMS) {
+                fprintf(stderr, "Schedule: invalid parameter \"%s\"\n", token);
+                return -1;
+            }
+            strcpy(event.params[event.paramCount++], token);
+        }
+    }
+
+    if (tokens == 0)
+        return 0;
+    if (tokens == 1) {
+        fprintf(stderr, "Schedule: missing mode after t=%g\n", event.time);
+        return -1;
+    }
+
+    if (addEvent(schedule, &event) == -1)
+        return -1;
+
+    if (duration > 0) {
+        ScheduleEvent restore;
+        memset(&restore, 0, sizeof(restore));
+        restore.time = event.time + duration;
+        restore.action = ScheduleRestore;
+        restore.restores = schedule->count - 1;
+        restore.link = event.link;
+        if (addEvent(schedule, &restore) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+int scheduleParse(Schedule *schedule, const char *text)
+{
+    memset(schedule, 0, sizeof(*schedule));
+
+    char *copy = strdup(text);
+    char *saveptr;
+    int result = 0;
+
+    for (char *entry = strtok_r(copy, ";\n", &saveptr); entry != NULL; entry = strtok_r(NULL, ";\n", &saveptr)) {
+        char *comment = strchr(entry, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        if (parseEntry(schedule, entry) == -1) {
+            result = -1;
+            break;
+        }
+    }
+    free(copy);
+
+    if (result == -1)
+        return -1;
+
+    // Stable insertion sort by time, keeping "restores" pointing at the same events
+    for (int i = 1; i < schedule->count; i++) {
+        for (int j = i; j > 0 && schedule->events[j - 1].time > schedule->events[j].time; j--) {
+            ScheduleEvent swap = schedule->events[j];
+            schedule->events[j] = schedule->events[j - 1];
+            schedule->events[j - 1] = swap;
+
+            for (int k = 0; k < schedule->count; k++) {
+                if (schedule->events[k].restores == j)
+                    schedule->events[k].restores = j - 1;
+                else if (schedule->events[k].restores == j - 1)
+                    schedule->events[k].restores = j;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int scheduleLoad(Schedule *schedule, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *text = (char *)malloc(size + 1);
+    size_t n = fread(text, 1, size, file);
+    text[n] = '\0';
+    fclose(file);
+
+    int result = scheduleParse(schedule, text);
+    free(text);
+    return result;
+}
+
+const char *scheduleActionName(ScheduleAction action)
+{
+    switch (action) {
+        case ScheduleOn: return "on";
+        case ScheduleOff: return "off";
+        case ScheduleNoise: return "noise";
+        case ScheduleEnd: return "end";
+        case ScheduleRestore: return "restore";
+        default: return "?";
+    }
+}
@@ -0,0 +1,51 @@
+// Fault schedule header.
+// A schedule is a list of timed cable commands, separated by ';' or new lines:
+//   t=2.0s off; t=3.5s on; t=5s noise ber=1e-4 for 1s; t=20s end
+// Times count from the first byte the cable receives. "for D" restores the
+// previous mode and parameters D later. A "LINK:" prefix on the mode limits
+// it to one link of a hub ("t=1s 2:off"). Parameters use the channel syntax
+// ([LINK:][tx.|rx.]key=value) and stay in effect until changed again.
+
+#ifndef _SCHEDULE_H_
+#define _SCHEDULE_H_
+
+#define SCHEDULE_MAX_EVENTS 256
+#define SCHEDULE_MAX_PARAMS 8
+#define SCHEDULE_PARAM_SIZE 64
+
+typedef enum
+{
+    ScheduleOn,
+    ScheduleOff,
+    ScheduleNoise,
+    ScheduleEnd,
+    ScheduleRestore, // End of an event with a duration
+} ScheduleAction;
+
+typedef struct
+{
+    double time;
+    ScheduleAction action;
+    int link;     // Link whose mode changes, -1 = every link
+    int restores; // ScheduleRestore: index of the event whose state is restored
+    int paramCount;
+    char params[SCHEDULE_MAX_PARAMS][SCHEDULE_PARAM_SIZE];
+} ScheduleEvent;
+
+typedef struct
+{
+    ScheduleEvent events[SCHEDULE_MAX_EVENTS];
+    int count;
+} Schedule;
+
+// Parse a schedule from text. Events are sorted by time.
+// Return "0" on success or "-1" on error (printed on stderr).
+int scheduleParse(Schedule *schedule, const char *text);
+
+// Read and parse a schedule file. Return "0" on success or "-1" on error.
+int scheduleLoad(Schedule *schedule, const char *path);
+
+// Name of an action for the summary.
+const char *scheduleActionName(ScheduleAction action);
+
+#endif // _SCHEDULE_H_
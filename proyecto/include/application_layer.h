@@ -1,18 +1,37 @@
 // Application layer protocol header.
-// NOTE: This file must not be changed.
 
 #ifndef _APPLICATION_LAYER_H_
 #define _APPLICATION_LAYER_H_
 
+// Optional behaviour of the application layer. All zeros means the defaults.
+typedef struct
+{
+    int resume;      // tx: continue from the offset the receiver has already verified
+    int payloadSize; // tx: file bytes per data packet, at most MAX_PAYLOAD_SIZE - 11
+    double propagationDelay; // tx: one-way propagation delay of the line (t_prop), in seconds
+    int mapFile;     // tx: send from a read-only mapping of the file instead of read() calls
+    int fsyncPolicy; // rx: FsyncNone, FsyncEnd or FsyncInterval (see write_behind.h)
+    long fsyncInterval; // rx: bytes between fdatasync() calls with FsyncInterval
+    int delta;       // tx: send only the blocks missing from the receiver's old copy of the file
+    int compress;    // tx: zlib level (1-9) of the compressed data stream, 0 = off
+    int batch;       // tx: filename is a directory or a list of files, sent in one session
+                     // rx: filename is the directory the files are received into
+    int tune;        // tx: TuneOff, TuneSaved or TuneNew (see tuning.h)
+} ApplicationLayerOptions;
+
+// Set the options used by the following applicationLayer() calls.
+void applicationLayerSetOptions(const ApplicationLayerOptions *options);
+
 // Application layer main function.
 // Arguments:
 //   serialPort: Serial port name (e.g., /dev/ttyS0).
 //   role: Application role {"tx", "rx"}.
 //   baudrate: Baudrate of the serial port.
 //   nTries: Maximum number of frame retries.
-//   timeout: Frame timeout.
-//   filename: Name of the file to send / receive.
+//   timeout: Frame timeout in seconds.
+//   filename: Name of the file to send / receive (a directory or list with batch),
+//             or "-" for stdin / stdout.
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename);
+                      int nTries, double timeout, const char *filename);
 
 #endif // _APPLICATION_LAYER_H_
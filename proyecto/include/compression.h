@@ -0,0 +1,89 @@
+// Compression pipeline header.
+// The transmitter compresses the file in large blocks on a worker thread, ahead
+// of the link layer, and the receiver decompresses them on its own worker, so
+// compression and line time overlap. The stream is a sequence of blocks:
+//   [type][original size, 4 bytes][stored size, 4 bytes][stored bytes]
+// with type COMPRESS_STORED (incompressible block) or COMPRESS_DEFLATE (zlib).
+
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "hash.h"
+#include "spsc_queue.h"
+#include "write_behind.h"
+
+#define COMPRESS_BLOCK_SIZE (256 * 1024)
+#define COMPRESS_HEADER_SIZE 9
+
+// Blocks queued between the worker and the link, in each direction
+#define COMPRESS_QUEUE 4
+
+#define COMPRESS_STORED 0
+#define COMPRESS_DEFLATE 1
+
+typedef struct
+{
+    unsigned char *data; // Header and stored bytes
+    size_t size;
+} CompressedBlock;
+
+typedef struct
+{
+    int fd;
+    off_t size;
+    int level;
+    HashState *hash;
+    uint64_t compressed; // Stream bytes produced
+    SpscQueue queue;     // Worker -> link, NULL at the end
+    int drained;         // The NULL has been popped
+    pthread_t thread;
+    atomic_int stop;
+    atomic_int error;
+} Compressor;
+
+typedef struct
+{
+    WriteBehind *writeBehind;
+    HashState *hash;
+    uint64_t written;  // File bytes handed to the writer
+    SpscQueue queue;   // Link -> worker, NULL at the end
+    pthread_t thread;
+    atomic_int error;
+    // Block being assembled from the packets
+    unsigned char header[COMPRESS_HEADER_SIZE];
+    size_t headerUsed;
+    CompressedBlock *current;
+    size_t used;
+} Decompressor;
+
+// Start compressing the first size bytes of fd with a zlib level (1-9), adding
+// the original data to hash. Return "0" on success or "-1" on error.
+int compressorStart(Compressor *compressor, int fd, off_t size, int level, HashState *hash);
+
+// Next block of the stream, NULL once the file is done or on error.
+CompressedBlock *compressorNext(Compressor *compressor);
+
+void compressorRelease(CompressedBlock *block);
+
+// Stop the worker, even if blocks were left unread.
+// Return "0" if the whole file was compressed or "-1" on error.
+int compressorFinish(Compressor *compressor);
+
+// Start the worker that decompresses into writeBehind, from file offset 0,
+// adding the data to hash. Return "0" on success or "-1" on error.
+int decompressorStart(Decompressor *decompressor, WriteBehind *writeBehind, HashState *hash);
+
+// Add the next size bytes of the stream. Only blocks if the worker is
+// COMPRESS_QUEUE blocks behind. Return "0" or "-1" on a malformed stream or error.
+int decompressorFeed(Decompressor *decompressor, const unsigned char *data, size_t size);
+
+// Wait for the worker to decompress what was fed and stop it.
+// Return "0" on success or "-1" on error. *written is the size of the file.
+int decompressorFinish(Decompressor *decompressor, uint64_t *written);
+
+#endif // _COMPRESSION_H_
@@ -0,0 +1,57 @@
+// Block delta header.
+// rsync-style signatures: the receiver describes the blocks of its old copy
+// with a rolling (weak) and a strong checksum, the transmitter looks them up at
+// every offset of the new file and sends copy instructions for the matches.
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_MIN_BLOCK 512
+
+// Most blocks in one signature list (12 MiB on the line), larger files get larger blocks
+#define DELTA_MAX_BLOCKS (1 << 20)
+
+// Size of one block signature on the line: weak (4 bytes) and strong (8 bytes)
+#define DELTA_SIGNATURE_SIZE 12
+
+typedef struct
+{
+    uint32_t weak;
+    uint64_t strong;
+} DeltaSignature;
+
+// Open-addressing table of signatures by weak checksum
+typedef struct
+{
+    const DeltaSignature *signatures;
+    int *slots;    // Block index + 1, 0 = empty
+    unsigned mask; // Number of slots - 1 (power of two)
+} DeltaIndex;
+
+// Block size for a file of size bytes: about sqrt(size), at least DELTA_MIN_BLOCK
+// and large enough for at most DELTA_MAX_BLOCKS blocks.
+size_t deltaBlockSize(uint64_t size);
+
+// Rolling checksum of size bytes.
+uint32_t deltaWeak(const unsigned char *data, size_t size);
+
+// Slide the weak checksum of a blockSize window one byte: drop out, add in.
+uint32_t deltaRoll(uint32_t weak, unsigned char out, unsigned char in, size_t blockSize);
+
+// Strong checksum of size bytes.
+uint64_t deltaStrong(const unsigned char *data, size_t size);
+
+// Index count signatures, which must outlive the index. Return "0" or "-1".
+int deltaIndexBuild(DeltaIndex *index, const DeltaSignature *signatures, int count);
+
+// Find a block with this weak checksum whose strong checksum matches the data.
+// The strong checksum is only computed if the weak one is known.
+// Return the block index or -1.
+int deltaIndexFind(const DeltaIndex *index, uint32_t weak, const unsigned char *data, size_t size);
+
+void deltaIndexFree(DeltaIndex *index);
+
+#endif // _DELTA_H_
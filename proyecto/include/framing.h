@@ -0,0 +1,50 @@
+// Framing kernels header.
+// The byte-level work of the link layer (BCC, byte stuffing, destuffing and
+// the frame parser) as pure functions, without file descriptors or globals.
+// Both link layers use them, and bin/microbench times each one on its own.
+
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include <stddef.h>
+
+#define FRAME_FLAG 0x7E
+#define FRAME_ESC 0x7D
+#define FRAME_ESC_XOR 0x20 // An escaped byte is sent as ESC, byte ^ 0x20
+
+// XOR of size bytes, continuing from bcc (0 for a new frame).
+unsigned char frameBcc(unsigned char bcc, const unsigned char *data, size_t size);
+
+// Stuff size bytes into out, which must hold 2 * size bytes (every byte escaped),
+// and fold them into *bcc in the same pass. Return the bytes written.
+size_t frameStuff(unsigned char *out, const unsigned char *data, size_t size, unsigned char *bcc);
+
+// Undo the stuffing of the size bytes between two flags into out.
+// Return the bytes written, or -1 if they do not fit in capacity or the data
+// ends with a lone ESC.
+int frameDestuff(unsigned char *out, size_t capacity, const unsigned char *in, size_t size);
+
+// Whether an I-frame with this control byte repeats the frame accepted last
+// (its RR was lost), for a receiver whose next RR carries nr. The repeat is
+// answered with RR(nr ^ 1) again and not delivered.
+int frameIsRepeat(unsigned char control, unsigned char nr);
+
+// Incremental frame parser: collects the destuffed bytes between two flags
+// into a buffer owned by the caller. Frames that overflow it are dropped.
+typedef struct
+{
+    unsigned char *frame;
+    int capacity;
+    int size;
+    int escaped;
+    int overflow;
+} FrameParser;
+
+void frameParserInit(FrameParser *parser, unsigned char *frame, int capacity);
+
+// Feed size bytes. Stop after the flag that closes a frame and return its size
+// (the frame is in parser->frame until the next call), or return 0 once all the
+// bytes are used. *consumed is set to the bytes used either way.
+int frameParse(FrameParser *parser, const unsigned char *bytes, int size, int *consumed);
+
+#endif // _FRAMING_H_
@@ -0,0 +1,40 @@
+// File hash header.
+// Incremental 64-bit hash (XXH64) used to identify and verify transferred files.
+
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef struct
+{
+    uint64_t acc[4];
+    uint64_t totalSize;
+    unsigned char pending[32];
+    size_t pendingSize;
+    uint64_t seed;
+} HashState;
+
+// Start a new hash.
+void hashInit(HashState *state, uint64_t seed);
+
+// Add size bytes of data to the hash.
+void hashUpdate(HashState *state, const void *data, size_t size);
+
+// Add length zero bytes to the hash (file holes), without reading any memory.
+void hashZeros(HashState *state, uint64_t length);
+
+// Return the hash of all the data added so far. The state can keep being updated.
+uint64_t hashDigest(const HashState *state);
+
+// Add the first size bytes of an open file (all of it if size is -1) to the hash,
+// leaving its offset untouched. Return "0" on success or "-1" on error.
+int hashFilePrefix(int fd, off_t size, HashState *state);
+
+// Hash the whole content of an open file, leaving its offset untouched.
+// Return "0" on success or "-1" on error.
+int hashFile(int fd, uint64_t *digest);
+
+#endif // _HASH_H_
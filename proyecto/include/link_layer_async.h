@@ -0,0 +1,75 @@
+// Asynchronous link layer header.
+// Non-blocking variant of llwrite / llread for an already opened connection,
+// meant to be driven from an existing poll / epoll event loop.
+
+#ifndef _LINK_LAYER_ASYNC_H_
+#define _LINK_LAYER_ASYNC_H_
+
+#include <sys/uio.h>
+
+// Maximum number of frames that can be queued with llwriteAsync().
+#define LL_ASYNC_QUEUE_SIZE 8
+
+// Called when a frame submitted with llwriteAsync() is acknowledged
+// (result = number of chars written) or dropped after all retries (result = -1).
+typedef void (*LlWriteCallback)(void *context, int result);
+
+// Called for every new frame received in asynchronous mode.
+// size = 0 means the other end started the disconnection (see llclose).
+typedef void (*LlReadCallback)(void *context, const unsigned char *packet, int size);
+
+// Switch the connection opened with llopen() to asynchronous mode.
+// onRead may be NULL if the caller only writes.
+// Return a pollable file descriptor that becomes readable whenever llprocess()
+// has work to do, or "-1" on error.
+int llasyncStart(LlReadCallback onRead, void *readContext);
+
+// Return the pollable file descriptor, or "-1" if asynchronous mode is off.
+int llasyncFd();
+
+// Queue buf to be sent. The data is framed immediately so buf can be reused
+// as soon as the call returns.
+// Return bufSize, or "-1" on error or if the queue is full.
+int llwriteAsync(const unsigned char *buf, int bufSize, LlWriteCallback onWrite, void *context);
+
+// Same as llwriteAsync() for a packet made of several buffers (e.g. a header
+// and a slice of a mapped file), stuffed straight into the frame.
+int llwriteAsyncv(const struct iovec *iov, int iovCount, LlWriteCallback onWrite, void *context);
+
+// A frame built ahead of time, see llframe().
+typedef struct
+{
+    unsigned char *data;
+    int size;    // Bytes on the wire
+    int bufSize; // Bytes of the packet
+} LlFrame;
+
+// Frame a packet for llwriteAsyncFrame(). Uses no link state, so a pipeline
+// stage on another thread can stuff the next packets while the link is busy.
+// Return NULL on error or if the packet is empty or larger than MAX_PAYLOAD_SIZE.
+LlFrame *llframe(const struct iovec *iov, int iovCount);
+
+void llframeFree(LlFrame *frame);
+
+// Queue a frame built with llframe(), which the link layer frees from then on
+// (also on error). Return its packet size, or "-1" on error or if the queue is full.
+int llwriteAsyncFrame(LlFrame *frame, LlWriteCallback onWrite, void *context);
+
+// Return the number of frames queued or waiting for acknowledgement.
+int llasyncPending();
+
+// Handle every pending event without blocking (data received, frame
+// acknowledged, retransmission timeout). Callbacks run from this function.
+// Return the number of callbacks run, or "-1" on error.
+int llprocess();
+
+// Wait up to timeoutMs milliseconds (-1 = forever) for events and process them.
+// Return the number of callbacks run, or "-1" on error.
+int llasyncWait(int timeoutMs);
+
+// Return to blocking mode so llwrite / llread / llclose can be used again.
+// Frames still queued are dropped without calling their callbacks.
+// Return "1" on success or "-1" on error.
+int llasyncStop();
+
+#endif // _LINK_LAYER_ASYNC_H_
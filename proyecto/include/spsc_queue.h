@@ -0,0 +1,42 @@
+// Single-producer single-consumer queue header.
+// Ring of pointers between exactly two threads, with semaphores counting the
+// items and the free slots: every push and pop goes through one of them. The
+// try variants never block; spscPush / spscPop sleep on a semaphore while the
+// queue is full / empty.
+
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <semaphore.h>
+#include <stdatomic.h>
+
+typedef struct
+{
+    void **slots;
+    unsigned capacity;      // Power of two
+    atomic_uint head;       // Next slot to pop, only written by the consumer
+    atomic_uint tail;       // Next slot to push, only written by the producer
+    sem_t items;
+    sem_t space;
+} SpscQueue;
+
+// Create a queue holding up to capacity items (rounded up to a power of two).
+// Return "0" on success or "-1" on error.
+int spscInit(SpscQueue *queue, unsigned capacity);
+
+void spscDestroy(SpscQueue *queue);
+
+// Producer side. Return "0" on success or "-1" if the queue is full.
+int spscTryPush(SpscQueue *queue, void *item);
+
+// Producer side, waiting for room.
+void spscPush(SpscQueue *queue, void *item);
+
+// Consumer side. Return the oldest item, or NULL if the queue is empty.
+// (NULL items can be pushed as markers only with spscPop.)
+void *spscTryPop(SpscQueue *queue);
+
+// Consumer side, waiting for an item.
+void *spscPop(SpscQueue *queue);
+
+#endif // _SPSC_QUEUE_H_
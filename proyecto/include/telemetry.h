@@ -0,0 +1,74 @@
+// Transfer telemetry header.
+// Live counters of a transfer (bytes done, rate, round-trip time, link
+// counters, time left) published in a POSIX shared memory segment,
+// /dev/shm/llstat.<pid>, that bin/llstat reads while the transfer runs.
+// The link thread refreshes the segment at most every TELEMETRY_INTERVAL and
+// prints a progress line at most every TELEMETRY_CONSOLE_INTERVAL, so the data
+// path only pays for a clock read per packet.
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "link_layer.h"
+
+#define TELEMETRY_MAGIC 0x4C4C5354 // "LLST"
+#define TELEMETRY_VERSION 1
+
+// Segment name, followed by the pid
+#define TELEMETRY_PREFIX "llstat."
+
+#define TELEMETRY_INTERVAL 0.1
+#define TELEMETRY_CONSOLE_INTERVAL 1.0
+
+// Total of a file whose size is not known (compressed stream, pipe)
+#define TELEMETRY_UNKNOWN UINT64_MAX
+
+typedef enum
+{
+    TelemetryIdle,    // Connected, between files
+    TelemetryRunning, // Sending or receiving a file
+    TelemetryDone,    // All files transferred
+    TelemetryFailed,
+} TelemetryState;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    atomic_uint sequence; // Odd while the fields below are being updated
+    int32_t pid;
+    int32_t role;         // LinkLayerRole
+    int32_t state;        // TelemetryState
+    char port[64];
+    char file[256];
+    uint32_t fileIndex;   // From 0
+    uint32_t fileCount;
+    uint64_t total;       // Bytes of the current file, TELEMETRY_UNKNOWN if not known
+    uint64_t done;        // Bytes acknowledged (tx) or received (rx)
+    double rate;          // Bytes per second over the last TELEMETRY_CONSOLE_INTERVAL
+    double eta;           // Seconds left at that rate, -1 if not known
+    double started;       // CLOCK_MONOTONIC time the session started
+    double updated;       // CLOCK_MONOTONIC time of this update
+    LinkLayerStats link;
+} TelemetryBlock;
+
+// Create the segment of this process. Without it progress is still printed.
+// Return "0" on success or "-1" on error.
+int telemetryOpen(const char *port, int role);
+
+// A new file starts, with done of its total bytes already there (resume).
+void telemetryFile(const char *name, int index, int count, uint64_t total, uint64_t done);
+
+// Count bytes done. Can be called from any thread.
+void telemetryProgress(uint64_t bytes);
+
+// Publish the counters if TELEMETRY_INTERVAL has passed. Link thread only.
+void telemetryTick();
+
+// Publish the final state and remove the segment.
+void telemetryClose(TelemetryState state);
+
+#endif // _TELEMETRY_H_
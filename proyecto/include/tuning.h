@@ -0,0 +1,47 @@
+// Link auto-tuning header.
+// At the start of a session the transmitter sends short bursts of probe
+// packets of two sizes and times their acknowledgements. The difference gives
+// the time per byte on the line (its sustainable rate), the small probes the
+// fixed round-trip latency, and the retransmissions the byte error rate. From
+// that model the payload size with the best goodput is chosen, with a
+// timeout and a retry count to match. Profiles are saved per serial port.
+
+#ifndef _TUNING_H_
+#define _TUNING_H_
+
+#define TUNE_SMALL_PROBE 32
+#define TUNE_PROBES 6          // Of each size, at most
+#define TUNE_MIN_PROBES 2      // Of each size, even past the time budget
+#define TUNE_BUDGET 3.0        // Seconds of probing
+#define TUNE_MIN_TIMEOUT 0.1   // Seconds
+#define TUNE_MAX_TRIES 20
+
+typedef enum
+{
+    TuneOff,
+    TuneSaved, // Use the saved profile of the port, probe if there is none
+    TuneNew,   // Probe and replace the saved profile
+} TuneMode;
+
+typedef struct
+{
+    int payloadSize;      // File bytes per data packet
+    double timeout;       // Seconds
+    int nRetransmissions;
+    double latency;       // Round trip of an empty frame, seconds
+    double lineRate;      // Bits per second (10 per byte, 8N1)
+    double byteErrorRate; // Probability that a byte on the line is corrupted
+} LinkProfile;
+
+// Probe the open connection (transmitter) and fill in the measurements and the
+// parameters for data packets of at most maxPayload file bytes.
+// Return "0" on success or "-1" if the link failed.
+int tuneLink(LinkProfile *profile, int maxPayload);
+
+// Load or save the profile of a serial port. Profiles are text files in
+// $LL_PROFILE_DIR, or ~/.config/serial_link, and can be edited by hand.
+// Return "0" on success or "-1" on error.
+int loadProfile(const char *serialPort, LinkProfile *profile);
+int saveProfile(const char *serialPort, const LinkProfile *profile);
+
+#endif // _TUNING_H_
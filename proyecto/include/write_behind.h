@@ -0,0 +1,77 @@
+// Receiver write-behind header.
+// Received data is collected in large aligned buffers that a writer thread
+// stores with pwrite(), so a slow disk never delays the next llread() and
+// its acknowledgement.
+
+#ifndef _WRITE_BEHIND_H_
+#define _WRITE_BEHIND_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "spsc_queue.h"
+
+#define WRITE_BEHIND_BUFFER_SIZE (1 << 20)
+#define WRITE_BEHIND_BUFFERS 4
+
+// A partly filled buffer is handed to the writer after this many seconds,
+// so a slow line still reaches the disk (and the resume journal) regularly
+#define WRITE_BEHIND_MAX_DELAY 1.0
+
+// Start offset for a stream (pipe, stdout): the data is written in order with
+// write(), and each write goes to the writer at once so the reader of the pipe
+// gets it as it arrives. There is nothing to fsync.
+#define WRITE_BEHIND_STREAM ((off_t) -1)
+
+typedef enum
+{
+    FsyncNone,     // Leave it to the kernel
+    FsyncEnd,      // Once, when the file is complete
+    FsyncInterval, // Every fsyncInterval bytes and at the end
+} FsyncPolicy;
+
+// Called from the writer thread after each buffer, with the offset where it ends.
+// With in-order writes the file then holds every byte before offset.
+typedef void (*WrittenCallback)(void *context, off_t offset);
+
+typedef struct
+{
+    unsigned char *data;
+    size_t used;
+    off_t offset; // File offset of data[0]
+    double started; // Time of the first byte
+} WriteBuffer;
+
+typedef struct
+{
+    int fd;
+    int stream;           // Started with WRITE_BEHIND_STREAM
+    FsyncPolicy fsyncPolicy;
+    off_t fsyncInterval;
+    WrittenCallback onWritten;
+    void *context;
+    WriteBuffer buffers[WRITE_BEHIND_BUFFERS];
+    WriteBuffer *current; // Being filled by the receiver, NULL if none
+    off_t offset;         // Next file offset to fill
+    SpscQueue full;       // Receiver -> writer
+    SpscQueue empty;      // Writer -> receiver
+    pthread_t thread;
+    atomic_int error;
+} WriteBehind;
+
+// Start the writer thread for fd, filling the file from offset (or WRITE_BEHIND_STREAM).
+// onWritten may be NULL. Return "0" on success or "-1" on error.
+int writeBehindStart(WriteBehind *wb, int fd, off_t offset, FsyncPolicy policy, off_t fsyncInterval,
+                     WrittenCallback onWritten, void *context);
+
+// Write size bytes at file offset. Consecutive writes are gathered into one buffer,
+// a write elsewhere hands the current buffer to the writer first. Only blocks if
+// the writer is WRITE_BEHIND_BUFFERS buffers behind.
+// Return "0" on success or "-1" if a previous write failed.
+int writeBehindWrite(WriteBehind *wb, off_t offset, const unsigned char *data, size_t size);
+
+// Write what is left, apply the fsync policy and stop the thread.
+// Return "0" on success or "-1" if any write failed.
+int writeBehindFinish(WriteBehind *wb);
+
+#endif // _WRITE_BEHIND_H_
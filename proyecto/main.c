@@ -1,10 +1,12 @@
 // Main file of the serial port project.
-// NOTE: This file must not be changed.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "application_layer.h"
+#include "tuning.h"
+#include "write_behind.h"
 
 #define BAUDRATE 9600
 #define N_TRIES 3
@@ -13,12 +15,115 @@
 // Arguments:
 //   $1: /dev/ttySxx
 //   $2: tx | rx
-//   $3: filename
+//   $3: filename, or "-" for stdin (tx) / stdout (rx)
+//   $4...: options
+//     --resume: continue an interrupted transfer (tx)
+//     --payload N: file bytes per data packet (tx)
+//     --baudrate N: baudrate of the serial port
+//     --tries N: attempts per frame before the link gives up
+//     --timeout S: retransmission timeout in seconds, fractions allowed
+//     --tprop S: propagation delay of the line, used in the efficiency report (tx)
+//     --mmap: send the file from a memory mapping, without read() calls (tx)
+//     --fsync none|end|BYTES: when the received file is flushed to disk (rx)
+//     --delta: only send the blocks that differ from the receiver's copy (tx)
+//     --compress [LEVEL]: compress the data on a worker thread, zlib level 1-9 (tx)
+//     --batch: send every file of a directory or list in one session (tx), or
+//              receive them into the directory filename (rx)
+//     --tune [new]: use the saved profile of the port, or probe the line and save
+//                   one (always with "new"): payload, timeout and tries (tx)
 int main(int argc, char *argv[])
 {
     if (argc < 4)
     {
-        printf("Usage: %s /dev/ttySxx tx|rx filename\n", argv[0]);
+        printf("Usage: %s /dev/ttySxx tx|rx filename|- [--resume] [--payload N] [--baudrate N] [--tprop S] [--mmap]\n"
+               "       [--fsync none|end|BYTES] [--batch] [--delta]\n"
+               "       [--compress [LEVEL]] [--tries N] [--timeout S] [--tune [new]]\n", argv[0]);
+        exit(1);
+    }
+
+    ApplicationLayerOptions options = {0};
+    int baudRate = BAUDRATE;
+    int nTries = N_TRIES;
+    double timeout = TIMEOUT;
+
+    for (int i = 4; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--resume") == 0)
+        {
+            options.resume = 1;
+        }
+        else if (strcmp(argv[i], "--payload") == 0 && i + 1 < argc)
+        {
+            options.payloadSize = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--baudrate") == 0 && i + 1 < argc)
+        {
+            baudRate = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tries") == 0 && i + 1 < argc)
+        {
+            nTries = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+        {
+            timeout = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tprop") == 0 && i + 1 < argc)
+        {
+            options.propagationDelay = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--fsync") == 0 && i + 1 < argc)
+        {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "none") == 0)
+                options.fsyncPolicy = FsyncNone;
+            else if (strcmp(policy, "end") == 0)
+                options.fsyncPolicy = FsyncEnd;
+            else
+            {
+                options.fsyncPolicy = FsyncInterval;
+                options.fsyncInterval = atol(policy);
+            }
+        }
+        else if (strcmp(argv[i], "--mmap") == 0)
+        {
+            options.mapFile = 1;
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            options.batch = 1;
+        }
+        else if (strcmp(argv[i], "--delta") == 0)
+        {
+            options.delta = 1;
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            options.compress = 6;
+            if (i + 1 < argc && argv[i + 1][0] >= '1' && argv[i + 1][0] <= '9' && argv[i + 1][1] == '\0')
+                options.compress = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tune") == 0)
+        {
+            options.tune = TuneSaved;
+            if (i + 1 < argc && strcmp(argv[i + 1], "new") == 0)
+            {
+                options.tune = TuneNew;
+                i++;
+            }
+        }
+        else
+        {
+            printf("Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+
+    // A delta rebuilds the file from the old copy, there is no partial file to resume,
+    // and compressed offsets do not point into the file
+    if (options.resume + options.delta + (options.compress > 0) > 1)
+    {
+        printf("--resume, --delta and --compress cannot be combined.\n");
         exit(1);
     }
 
@@ -26,21 +131,32 @@ int main(int argc, char *argv[])
     const char *role = argv[2];
     const char *filename = argv[3];
 
-    printf("Starting link-layer protocol application\n"
-           "  - Serial port: %s\n"
-           "  - Role: %s\n"
-           "  - Baudrate: %d\n"
-           "  - Number of tries: %d\n"
-           "  - Timeout: %d\n"
-           "  - Filename: %s\n",
-           serialPort,
-           role,
-           BAUDRATE,
-           N_TRIES,
-           TIMEOUT,
-           filename);
-
-    applicationLayer(serialPort, role, BAUDRATE, N_TRIES, TIMEOUT, filename);
+    // A stream is read or written once, in order, and its size is not known up front
+    int stream = strcmp(filename, "-") == 0;
+    if (stream && (options.resume || options.delta || options.compress || options.mapFile || options.batch))
+    {
+        printf("--resume, --delta, --compress, --mmap and --batch need a file, not \"-\".\n");
+        exit(1);
+    }
+
+    // With "-" stdout may carry the data, the log goes to stderr
+    fprintf(stream ? stderr : stdout,
+            "Starting link-layer protocol application\n"
+            "  - Serial port: %s\n"
+            "  - Role: %s\n"
+            "  - Baudrate: %d\n"
+            "  - Number of tries: %d\n"
+            "  - Timeout: %g\n"
+            "  - Filename: %s\n",
+            serialPort,
+            role,
+            baudRate,
+            nTries,
+            timeout,
+            filename);
+
+    applicationLayerSetOptions(&options);
+    applicationLayer(serialPort, role, baudRate, nTries, timeout, filename);
 
     return 0;
 }
@@ -1,84 +1,1809 @@
 // Application layer protocol implementation
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <linux/falloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <math.h>
 #include <time.h>
 
 #include "application_layer.h"
+#include "compression.h"
+#include "delta.h"
+#include "hash.h"
 #include "link_layer.h"
-
-#include "application_layer.h"
+#include "link_layer_async.h"
+#include "spsc_queue.h"
+#include "telemetry.h"
+#include "tuning.h"
+#include "write_behind.h"
 
 #define C_DATA 1
+#define C_START 2
 #define C_END 3
+#define C_RESUME 4
+#define C_DATA_AT 5 // Data packet with the file offset of its first byte
+
+// [C_DATA_AT][offset, 8 bytes big-endian][L2][L1][data]
+#define DATA_HEADER_SIZE 11
+
+// Delta transfers (see delta.h)
+#define C_SIGNATURE 6 // rx -> tx: T_BLOCK and T_BLOCKS of the old copy
+#define C_BLOCKS 7    // rx -> tx: [C_BLOCKS][weak, 4 bytes][strong, 8 bytes]...
+#define C_COPY 8      // [C_COPY][offset, 8 bytes][source offset, 8 bytes][length, 4 bytes]
+#define COPY_PACKET_SIZE 21
+
+// 9 is C_PROBE, sent by the link tuner before the first file (see tuning.c)
+
+// Sparse files: a run of zero bytes that is not sent, the receiver leaves a hole
+#define C_HOLE 10 // [C_HOLE][offset, 8 bytes][length, 8 bytes]
+#define HOLE_PACKET_SIZE 17
+
+// Zero runs inside the data are found page by page
+#define ZERO_PAGE_SIZE 4096
+
+// Control packets are [C][T][L][V]... with one byte type and length fields.
+// Numbers are big-endian with as many bytes as they need (up to 8, so sizes and
+// offsets are 64-bit), unknown types are skipped and every field but T_SIZE is
+// optional (T_SIZE is only in the end packet of a stream).
+#define T_SIZE 0   // File size in bytes
+#define T_NAME 1   // File name, without directories
+#define T_HASH 2   // XXH64 of the file: start packet with T_RESUME, always in the end packet
+#define T_RESUME 3 // Start: resume request (empty). C_RESUME: verified offset
+#define T_CHUNK 4  // Largest number of file bytes in a data packet
+#define T_MODE 5   // Permission bits
+#define T_MTIME 6  // Modification time in nanoseconds since the epoch
+#define T_INDEX 7  // Batch: position of the file, from 0
+#define T_COUNT 8  // Batch: number of files
+#define T_DELTA 9  // Start: delta request (empty), answered with C_SIGNATURE
+#define T_BLOCK 10 // Signature: block size
+#define T_BLOCKS 11 // Signature: number of blocks
+#define T_COMPRESS 12 // Start: data packets carry a compressed stream (see compression.h)
+#define T_STREAM 13 // Start: the length is not known (stdin), T_SIZE comes in the end packet
+
+#define COMPRESS_ZLIB 1
+
+// Data packets handed to the link layer ahead of the acknowledgements: one in
+// flight and the next one already read and framed
+#define TX_WINDOW 2
+
+// Receiver journal of the verified offset, saved every JOURNAL_INTERVAL bytes
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_INTERVAL 32768
+
+typedef struct {
+    uint32_t magic;
+    uint64_t size;
+    uint64_t hash;
+    uint64_t offset;
+} ResumeJournal;
+
+// Resume journal kept up to date by the write-behind thread
+typedef struct {
+    int journalFd;
+    int fd;
+    ResumeJournal journal;
+    uint64_t journaled;
+} JournalState;
+
 double t_prop;
+ApplicationLayerOptions options;
 
-void applicationLayer(const char *serialPort, const char *role, int baudRate,
-                      int nTries, int timeout, const char *filename)
+void applicationLayerSetOptions(const ApplicationLayerOptions *newOptions)
 {
-    
-    int size_aux=  0; 
+    options = *newOptions;
+    t_prop = options.propagationDelay;
+}
+
+double monotonicSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Wait for a packet of the given type for as long as a frame is retried.
+// Return its size, or "-1" if the peer does not send it in that time.
+int readReply(unsigned char *packet, unsigned char type) {
+    double deadline = monotonicSeconds() + llreplyTimeout();
+    double left;
+    while ((left = deadline - monotonicSeconds()) > 0) {
+        int size = llreadTimeout(packet, left);
+        if (size > 0 && packet[0] == type)
+            return size;
+    }
+    return -1;
+}
+
+// Compare the measured efficiency with the stop-and-wait model S = 1 / (1 + 2a),
+// where a = t_prop / t_frame and the line carries 10 bits per byte (8N1).
+void printEfficiency(uint64_t bytes, double seconds, int baudRate, long int chunkSize) {
+    double R = bytes * 8 / seconds;
+    double t_frame = (chunkSize + DATA_HEADER_SIZE + 6) * 10.0 / baudRate;
+    double a = t_prop / t_frame;
+
+    printf("\n--- Efficiency ---\n");
+    printf("Received bitrate R: %f bps\n", R);
+    printf("Efficiency S = R / C: %f\n", R / baudRate);
+    printf("t_frame: %f s, t_prop: %f s, a: %f\n", t_frame, t_prop, a);
+    printf("Stop-and-wait S = 1 / (1 + 2a): %f\n", 1 / (1 + 2 * a));
+}
+
+// Find the field "type" in a control packet.
+// Return its length and point value to it, or -1 if the field is missing.
+int findField(const unsigned char *packet, int packetSize, unsigned char type, const unsigned char **value) {
+    int iter = 1;
+    while (iter + 2 <= packetSize) {
+        int length = packet[iter + 1];
+        if (iter + 2 + length > packetSize)
+            return -1;
+        if (packet[iter] == type) {
+            *value = packet + iter + 2;
+            return length;
+        }
+        iter += 2 + length;
+    }
+    return -1;
+}
+
+// Read a big-endian number field, "0" if the field is missing or too long.
+uint64_t readNumberField(const unsigned char *packet, int packetSize, unsigned char type) {
+    const unsigned char *value;
+    int length = findField(packet, packetSize, type, &value);
+    if (length > 8)
+        return 0;
+    uint64_t number = 0;
+    for (int i = 0; i < length; i++) {
+        number <<= 8;
+        number += value[i];
+    }
+    return number;
+}
+
+// Write number in length big-endian bytes.
+void putNumber(unsigned char *p, uint64_t number, int length) {
+    for (int i = length - 1; i >= 0; i--) {
+        p[i] = number & 0xFF;
+        number >>= 8;
+    }
+}
+
+// Read a length bytes big-endian number.
+uint64_t getNumber(const unsigned char *p, int length) {
+    uint64_t number = 0;
+    for (int i = 0; i < length; i++)
+        number = (number << 8) | p[i];
+    return number;
+}
+
+// Bytes needed to write number, at least one.
+int numberLength(uint64_t number) {
+    int length = 1;
+    while (length < 8 && (number >> (8 * length)) != 0)
+        length++;
+    return length;
+}
+
+// Write a big-endian number field. Return the new packet size.
+int writeNumberField(unsigned char *packet, int iter, unsigned char type, uint64_t number, int length) {
+    packet[iter++] = type;
+    packet[iter++] = length;
+    for (int i = length - 1; i >= 0; i--) {
+        packet[iter + i] = number & 0xFF;
+        number >>= 8;
+    }
+    return iter + length;
+}
+
+// Load the journal of an interrupted reception. Return "0" if it exists.
+int loadJournal(const char *path, ResumeJournal *journal) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    int n = read(fd, journal, sizeof(*journal));
+    close(fd);
+    if (n != sizeof(*journal) || journal->magic != JOURNAL_MAGIC)
+        return -1;
+    return 0;
+}
+
+// Persist the verified offset. The data must be on disk before the journal says so.
+int saveJournal(int journalFd, int fd, const ResumeJournal *journal) {
+    if (fdatasync(fd) == -1)
+        return -1;
+    if (pwrite(journalFd, journal, sizeof(*journal), 0) != sizeof(*journal))
+        return -1;
+    return fdatasync(journalFd);
+}
+
+// Read exactly size bytes at offset unless the file ends first. Return the bytes read or -1 on error.
+long preadFull(int fd, unsigned char *buf, long size, off_t offset) {
+    long done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// True if the size bytes at data are all zero. memcmp against the data shifted
+// by one byte runs at the vectorized speed of the C library.
+int isZero(const unsigned char *data, size_t size) {
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+// Called by the asynchronous link layer when a data packet is acknowledged or given up on.
+void dataPacketSent(void *context, int result) {
+    if (result == -1) {
+        *(int *)context = TRUE;
+        return;
+    }
+    telemetryProgress(result - DATA_HEADER_SIZE);
+    telemetryTick();
+}
+
+// Write the header of a data packet with size bytes of data for offset.
+void dataPacketHeader(unsigned char *packet, uint64_t offset, long int size) {
+    packet[0] = C_DATA_AT;
+    putNumber(packet + 1, offset, 8);
+    packet[9] = (size >> 8) & 0xFF;
+    packet[10] = size & 0xFF;
+}
+
+// Transmit pipeline: a reader thread fills blocks from the file (and hashes
+// them), a packetizer thread cuts the blocks into data packets and frames them,
+// and the calling thread keeps the link busy with the frames. The stages are
+// joined by SPSC queues, so reading and byte stuffing overlap line time.
+// Holes of the file (SEEK_HOLE) and zero pages in the data are sent as hole
+// packets instead. For a delta the reader runs the block search and queues copy
+// instructions between the data blocks.
+#define TX_BLOCK_SIZE (64 * 1024)
+#define TX_BLOCKS 4
+#define TX_FRAMES 64
+#define TX_SPANS (2 * TX_FRAMES) // More than the hole and copy packets frames can hold
+
+// A stream block that is not full is sent this long after its first byte, so
+// a slow producer still gets its data on the line (seconds)
+#define STREAM_COALESCE 0.02
+
+typedef struct {
+    const unsigned char *data; // In buffer, or in the mapping. NULL for a hole or a copy.
+    unsigned char *buffer;
+    uint64_t size;
+    uint64_t offset;
+    uint32_t zeroPages; // Bit i: page i of the data is all zeros
+    int copy;           // size bytes of the receiver's old copy at source go to offset
+    uint64_t source;
+} TxBlock;
+
+typedef struct {
+    int fd;
+    const unsigned char *map;
+    uint64_t offset;
+    uint64_t bytesLeft;
+    long int chunkSize;
+    HashState *hash;
+    int stream;        // fd is a pipe read until its end, bytesLeft is not used
+    uint64_t streamed; // Stream bytes read, set by the reader at the end
+    const DeltaIndex *delta; // Blocks of the receiver's old copy, NULL unless sending a delta
+    size_t deltaBlockSize;
+    uint64_t literal;        // Bytes of a delta sent as data, set by the reader
+    TxBlock blocks[TX_BLOCKS];
+    SpscQueue full;   // Reader -> packetizer, NULL at the end
+    SpscQueue empty;  // Packetizer -> reader
+    SpscQueue frames; // Packetizer -> link, txEnd at the end or NULL on error
+    uint64_t spans[TX_SPANS]; // File bytes of the hole and copy packets in frames, in order
+    unsigned spanTail;        // Next span written by the packetizer
+    unsigned spanHead;        // Next span read by the link
+    pthread_t reader;
+    pthread_t packetizer;
+    atomic_int stop;     // Set by the link when it gives up
+    atomic_int error;
+    atomic_int finished; // The packetizer pushed its last frame
+} TxPipeline;
+
+// Marks the end of the frames, NULL is taken by spscTryPop for an empty queue
+static LlFrame txEnd;
+
+// Pushed before the frame of a hole or copy packet, whose length is in spans
+static LlFrame txSpan;
+
+// Frames on the line and the file bytes each one stands for, counted once it
+// is acknowledged. The link layer completes them in order.
+typedef struct {
+    int failed;
+    uint64_t bytes[LL_ASYNC_QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+} TxAcks;
+
+// Called by the asynchronous link layer when a frame of the pipeline is acknowledged or given up on.
+static void txPacketSent(void *context, int result) {
+    TxAcks *acks = (TxAcks *) context;
+    uint64_t bytes = acks->bytes[acks->head];
+    acks->head = (acks->head + 1) % LL_ASYNC_QUEUE_SIZE;
+    acks->count--;
+    if (result == -1) {
+        acks->failed = TRUE;
+        return;
+    }
+    telemetryProgress(bytes);
+    telemetryTick();
+}
+
+// Mark the pages of a data block that are all zeros.
+static void txFindZeroPages(TxBlock *block) {
+    for (uint64_t page = 0; page * ZERO_PAGE_SIZE < block->size; page++) {
+        uint64_t start = page * ZERO_PAGE_SIZE;
+        uint64_t size = block->size - start > ZERO_PAGE_SIZE ? ZERO_PAGE_SIZE : block->size - start;
+        if (isZero(block->data + start, size))
+            block->zeroPages |= 1u << page;
+    }
+}
+
+static void *txReader(void *arg) {
+    TxPipeline *p = (TxPipeline *) arg;
+    uint64_t offset = p->offset;
+    uint64_t end = p->offset + p->bytesLeft;
+    uint64_t dataEnd = offset; // End of the data region found with SEEK_HOLE
+
+    while (offset < end && !atomic_load(&p->stop)) {
+        TxBlock *block = (TxBlock *) spscPop(&p->empty);
+        block->offset = offset;
+        block->data = NULL;
+        block->zeroPages = 0;
+
+        // Holes are skipped without reading them. Without SEEK_DATA support
+        // (or a descriptor) the whole file counts as data.
+        if (offset >= dataEnd) {
+            dataEnd = end;
+            off_t data = p->fd != -1 ? lseek(p->fd, offset, SEEK_DATA) : (off_t) offset;
+            if (data == -1 && errno == ENXIO)
+                data = end;
+            if (data > (off_t) offset) {
+                block->size = ((uint64_t) data < end ? (uint64_t) data : end) - offset;
+                if (p->hash != NULL)
+                    hashZeros(p->hash, block->size);
+                spscPush(&p->full, block);
+                offset += block->size;
+                continue;
+            }
+            off_t hole = p->fd != -1 && data != -1 ? lseek(p->fd, offset, SEEK_HOLE) : -1;
+            if (hole > (off_t) offset && (uint64_t) hole < end)
+                dataEnd = hole;
+        }
+
+        block->size = dataEnd - offset > TX_BLOCK_SIZE ? TX_BLOCK_SIZE : dataEnd - offset;
+        if (p->map != NULL) {
+            block->data = p->map + (offset - p->offset);
+        } else if (preadFull(p->fd, block->buffer, block->size, offset) != (long) block->size) {
+            printf("Error reading the file, it may have changed while sending.\n");
+            atomic_store(&p->error, 1);
+            break;
+        } else {
+            block->data = block->buffer;
+        }
+        if (p->hash != NULL)
+            hashUpdate(p->hash, block->data, block->size);
+        txFindZeroPages(block);
+
+        spscPush(&p->full, block);
+        offset += block->size;
+    }
+
+    spscPush(&p->full, NULL);
+    return NULL;
+}
+
+// Stream reader: each block is filled with read() until it is full, the input
+// ends or STREAM_COALESCE has passed since its first byte. There are no holes.
+static void *txStreamReader(void *arg) {
+    TxPipeline *p = (TxPipeline *) arg;
+    uint64_t offset = 0;
+    int end = FALSE;
+
+    while (!end && !atomic_load(&p->stop)) {
+        TxBlock *block = (TxBlock *) spscPop(&p->empty);
+        block->offset = offset;
+        block->data = block->buffer;
+        block->size = 0;
+        block->zeroPages = 0;
+
+        double deadline = 0;
+        while (block->size < TX_BLOCK_SIZE && !atomic_load(&p->stop)) {
+            // Waits are bounded so the reader notices when the link gives up
+            int wait = 100;
+            if (block->size > 0) {
+                wait = (int) ((deadline - monotonicSeconds()) * 1000);
+                wait = wait < 0 ? 0 : wait;
+            }
+            struct pollfd pfd = {p->fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, wait);
+            if (ready == -1 && errno != EINTR) {
+                atomic_store(&p->error, 1);
+                end = TRUE;
+                break;
+            }
+            if (ready <= 0) {
+                if (block->size > 0 && monotonicSeconds() >= deadline)
+                    break;
+                continue;
+            }
+
+            ssize_t n = read(p->fd, block->buffer + block->size, TX_BLOCK_SIZE - block->size);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (n == -1) {
+                    printf("Error reading the input stream.\n");
+                    atomic_store(&p->error, 1);
+                }
+                end = TRUE;
+                break;
+            }
+            if (block->size == 0)
+                deadline = monotonicSeconds() + STREAM_COALESCE;
+            block->size += n;
+        }
+
+        if (block->size == 0 || atomic_load(&p->error)) {
+            spscPush(&p->empty, block);
+            continue;
+        }
+        if (p->hash != NULL)
+            hashUpdate(p->hash, block->data, block->size);
+        spscPush(&p->full, block);
+        offset += block->size;
+    }
+
+    p->streamed = offset;
+    spscPush(&p->full, NULL);
+    return NULL;
+}
+
+// Queue length bytes of the mapping at offset as data blocks, hashing them.
+// Return "0", or "-1" once the link has given up.
+static int txQueueData(TxPipeline *p, uint64_t offset, uint64_t length) {
+    uint64_t end = offset + length;
+    if (p->hash != NULL)
+        hashUpdate(p->hash, p->map + offset, length);
+    while (offset < end) {
+        if (atomic_load(&p->stop))
+            return -1;
+        TxBlock *block = (TxBlock *) spscPop(&p->empty);
+        block->copy = FALSE;
+        block->offset = offset;
+        block->data = p->map + offset;
+        block->size = end - offset > TX_BLOCK_SIZE ? TX_BLOCK_SIZE : end - offset;
+        block->zeroPages = 0;
+        txFindZeroPages(block);
+        spscPush(&p->full, block);
+        offset += block->size;
+    }
+    p->literal += length;
+    return 0;
+}
+
+// Queue a copy of length bytes of the old copy at source to offset. Same result.
+static int txQueueCopy(TxPipeline *p, uint64_t offset, uint64_t source, uint64_t length) {
+    if (atomic_load(&p->stop))
+        return -1;
+    // The copied bytes are in the new file too, while they are still in the cache
+    if (p->hash != NULL)
+        hashUpdate(p->hash, p->map + offset, length);
+    TxBlock *block = (TxBlock *) spscPop(&p->empty);
+    block->copy = TRUE;
+    block->offset = offset;
+    block->source = source;
+    block->size = length;
+    block->data = NULL;
+    spscPush(&p->full, block);
+    return 0;
+}
+
+// Delta reader: finds the blocks the receiver already has, at any offset, with
+// the rolling checksum, and queues copies for them and data blocks for the rest,
+// so the search runs while the link sends what it found so far.
+static void *txDeltaReader(void *arg) {
+    TxPipeline *p = (TxPipeline *) arg;
+    const unsigned char *map = p->map;
+    uint64_t size = p->bytesLeft;
+    size_t blockSize = p->deltaBlockSize;
+    uint64_t pos = 0, literalStart = 0;
+    uint64_t copyOffset = 0, copySource = 0, copyLength = 0; // Pending copy, merged with the next block
+    uint32_t weak = size >= blockSize ? deltaWeak(map, blockSize) : 0;
+    int result = 0;
+
+    while (result == 0 && pos + blockSize <= size) {
+        int block = deltaIndexFind(p->delta, weak, map + pos, blockSize);
+        if (block < 0) {
+            if (pos + blockSize < size)
+                weak = deltaRoll(weak, map[pos], map[pos + blockSize], blockSize);
+            pos++;
+            continue;
+        }
+
+        uint64_t source = (uint64_t) block * blockSize;
+        if (literalStart < pos || copySource + copyLength != source || copyLength + blockSize > UINT32_MAX) {
+            if (copyLength > 0)
+                result = txQueueCopy(p, copyOffset, copySource, copyLength);
+            if (result == 0 && literalStart < pos)
+                result = txQueueData(p, literalStart, pos - literalStart);
+            copyOffset = pos;
+            copySource = source;
+            copyLength = 0;
+        }
+        copyLength += blockSize;
+
+        pos += blockSize;
+        literalStart = pos;
+        if (pos + blockSize <= size)
+            weak = deltaWeak(map + pos, blockSize);
+    }
+
+    if (result == 0 && copyLength > 0)
+        result = txQueueCopy(p, copyOffset, copySource, copyLength);
+    if (result == 0 && literalStart < size)
+        txQueueData(p, literalStart, size - literalStart);
+
+    spscPush(&p->full, NULL);
+    return NULL;
+}
+
+// Queue one framed packet (a hole or copy packet after its marker). Return "0" or "-1".
+static int txPush(TxPipeline *p, const struct iovec *iov, int iovCount, int span) {
+    LlFrame *frame = llframe(iov, iovCount);
+    if (frame == NULL) {
+        atomic_store(&p->error, 1);
+        atomic_store(&p->stop, 1);
+        return -1;
+    }
+    if (span)
+        spscPush(&p->frames, &txSpan);
+    spscPush(&p->frames, frame);
+    return 0;
+}
+
+// Send the pending hole, if any.
+static int txFlushHole(TxPipeline *p, uint64_t *holeOffset, uint64_t *holeLength) {
+    if (*holeLength == 0)
+        return 0;
+
+    unsigned char packet[HOLE_PACKET_SIZE];
+    packet[0] = C_HOLE;
+    putNumber(packet + 1, *holeOffset, 8);
+    putNumber(packet + 9, *holeLength, 8);
+    struct iovec iov = {packet, HOLE_PACKET_SIZE};
+    p->spans[p->spanTail++ % TX_SPANS] = *holeLength;
+    if (txPush(p, &iov, 1, TRUE) == -1)
+        return -1;
+    *holeLength = 0;
+    return 0;
+}
+
+// Send a copy instruction. Return "0" or "-1".
+static int txPushCopy(TxPipeline *p, const TxBlock *block) {
+    unsigned char packet[COPY_PACKET_SIZE];
+    packet[0] = C_COPY;
+    putNumber(packet + 1, block->offset, 8);
+    putNumber(packet + 9, block->source, 8);
+    putNumber(packet + 17, block->size, 4);
+    struct iovec iov = {packet, COPY_PACKET_SIZE};
+    p->spans[p->spanTail++ % TX_SPANS] = block->size;
+    return txPush(p, &iov, 1, TRUE);
+}
+
+static void *txPacketizer(void *arg) {
+    TxPipeline *p = (TxPipeline *) arg;
+    unsigned char header[DATA_HEADER_SIZE];
+    uint64_t holeOffset = 0, holeLength = 0; // Zeros not sent yet, merged across blocks
+    TxBlock *block;
+
+    while ((block = (TxBlock *) spscPop(&p->full)) != NULL) {
+        if (block->copy) {
+            if (!atomic_load(&p->stop) && txFlushHole(p, &holeOffset, &holeLength) == 0)
+                txPushCopy(p, block);
+            spscPush(&p->empty, block);
+            continue;
+        }
+
+        // Runs of zero pages, and non-zero pages, of the block
+        uint64_t runEnd;
+        for (uint64_t done = 0; done < block->size && !atomic_load(&p->stop); done = runEnd) {
+            unsigned zero = block->data == NULL || (block->zeroPages >> (done / ZERO_PAGE_SIZE) & 1);
+            runEnd = block->size;
+            if (block->data != NULL) {
+                runEnd = done;
+                while (runEnd < block->size && (block->zeroPages >> (runEnd / ZERO_PAGE_SIZE) & 1) == zero)
+                    runEnd += ZERO_PAGE_SIZE;
+                if (runEnd > block->size)
+                    runEnd = block->size;
+            }
+
+            if (zero) {
+                if (holeLength > 0 && holeOffset + holeLength != block->offset + done
+                    && txFlushHole(p, &holeOffset, &holeLength) == -1)
+                    break;
+                if (holeLength == 0)
+                    holeOffset = block->offset + done;
+                holeLength += runEnd - done;
+                continue;
+            }
+            if (txFlushHole(p, &holeOffset, &holeLength) == -1)
+                break;
+
+            long dataSize;
+            for (uint64_t sent = done; sent < runEnd && !atomic_load(&p->stop); sent += dataSize) {
+                dataSize = runEnd - sent > (uint64_t) p->chunkSize ? p->chunkSize : (long) (runEnd - sent);
+                dataPacketHeader(header, block->offset + sent, dataSize);
+
+                struct iovec iov[2] = {{header, DATA_HEADER_SIZE}, {(void *) (block->data + sent), dataSize}};
+                if (txPush(p, iov, 2, FALSE) == -1)
+                    break;
+            }
+        }
+        spscPush(&p->empty, block);
+    }
+    if (!atomic_load(&p->stop))
+        txFlushHole(p, &holeOffset, &holeLength);
+
+    spscPush(&p->frames, atomic_load(&p->error) ? NULL : &txEnd);
+    atomic_store(&p->finished, 1);
+    return NULL;
+}
+
+static void txPipelineFree(TxPipeline *p) {
+    for (int i = 0; i < TX_BLOCKS; i++)
+        free(p->blocks[i].buffer);
+    spscDestroy(&p->full);
+    spscDestroy(&p->empty);
+    spscDestroy(&p->frames);
+}
+
+// Run the transmit pipeline set up in p until its data is acknowledged.
+// Return "0" on success or "-1" on error.
+static int txRun(TxPipeline *p) {
+    atomic_init(&p->stop, 0);
+    atomic_init(&p->error, 0);
+    atomic_init(&p->finished, 0);
+
+    // One extra slot in full and frames for the final marker
+    if (spscInit(&p->full, TX_BLOCKS + 1) == -1)
+        return -1;
+    if (spscInit(&p->empty, TX_BLOCKS) == -1) {
+        spscDestroy(&p->full);
+        return -1;
+    }
+    if (spscInit(&p->frames, TX_FRAMES + 1) == -1) {
+        spscDestroy(&p->full);
+        spscDestroy(&p->empty);
+        return -1;
+    }
+    for (int i = 0; i < TX_BLOCKS; i++) {
+        if (p->map == NULL && (p->blocks[i].buffer = (unsigned char *) malloc(TX_BLOCK_SIZE)) == NULL) {
+            txPipelineFree(p);
+            return -1;
+        }
+        spscPush(&p->empty, &p->blocks[i]);
+    }
+
+    if (llasyncStart(NULL, NULL) == -1) {
+        txPipelineFree(p);
+        return -1;
+    }
+    void *(*reader)(void *) = p->delta != NULL ? txDeltaReader : p->stream ? txStreamReader : txReader;
+    if (pthread_create(&p->reader, NULL, reader, p) != 0) {
+        llasyncStop();
+        txPipelineFree(p);
+        return -1;
+    }
+    if (pthread_create(&p->packetizer, NULL, txPacketizer, p) != 0) {
+        // Nobody returns the blocks: the reader stops once they are used up
+        atomic_store(&p->stop, 1);
+        for (TxBlock *block; (block = (TxBlock *) spscPop(&p->full)) != NULL;)
+            spscPush(&p->empty, block);
+        pthread_join(p->reader, NULL);
+        llasyncStop();
+        txPipelineFree(p);
+        return -1;
+    }
+
+    TxAcks acks;
+    memset(&acks, 0, sizeof(acks));
+    int done = FALSE;
+    int span = FALSE; // The next frame is a hole or copy packet
+    while (!acks.failed && (!done || llasyncPending() > 0)) {
+        if (done || llasyncPending() >= TX_WINDOW) {
+            if (llasyncWait(-1) == -1)
+                acks.failed = TRUE;
+            continue;
+        }
+
+        // With nothing on the line only the packetizer can make progress, wait for it
+        int idle = llasyncPending() == 0;
+        LlFrame *frame = (LlFrame *) (idle ? spscPop(&p->frames) : spscTryPop(&p->frames));
+        if (frame == &txEnd) {
+            done = TRUE;
+        } else if (frame == &txSpan) {
+            span = TRUE;
+        } else if (frame != NULL) {
+            uint64_t bytes = span ? p->spans[p->spanHead++ % TX_SPANS] : (uint64_t) (frame->bufSize - DATA_HEADER_SIZE);
+            acks.bytes[(acks.head + acks.count++) % LL_ASYNC_QUEUE_SIZE] = bytes;
+            if (llwriteAsyncFrame(frame, txPacketSent, &acks) == -1)
+                acks.failed = TRUE;
+            span = FALSE;
+        } else if (idle || atomic_load(&p->error)) {
+            acks.failed = TRUE;
+        } else if (llasyncWait(1) == -1) {
+            acks.failed = TRUE;
+        }
+    }
+
+    int failed = acks.failed;
+    if (failed) {
+        // Drop the frames left, the packetizer may be waiting for room
+        atomic_store(&p->stop, 1);
+        while (!atomic_load(&p->finished)) {
+            LlFrame *frame = (LlFrame *) spscTryPop(&p->frames);
+            if (frame == NULL || frame == &txEnd)
+                usleep(1000);
+            else if (frame != &txSpan)
+                llframeFree(frame);
+        }
+        for (LlFrame *frame; (frame = (LlFrame *) spscTryPop(&p->frames)) != NULL;)
+            if (frame != &txEnd && frame != &txSpan)
+                llframeFree(frame);
+    }
+    pthread_join(p->packetizer, NULL);
+    pthread_join(p->reader, NULL);
+    txPipelineFree(p);
+
+    if (llasyncStop() == -1)
+        return -1;
+    return failed || atomic_load(&p->error) ? -1 : 0;
+}
+
+// Send bytesLeft bytes of the file, starting at byte offset, as data packets,
+// through the transmit pipeline. Memory use does not depend on the file size.
+// With a mapping (map != NULL, pointing at the first byte to send) packets are
+// framed straight from it, without read() calls. The data sent is added to hash
+// unless it is NULL. Return "0" on success or "-1" on error.
+int sendFileData(int fd, const unsigned char *map, uint64_t offset, uint64_t bytesLeft,
+                 long int chunkSize, HashState *hash) {
+    if (bytesLeft == 0)
+        return 0;
+
+    TxPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.fd = fd;
+    p.map = map;
+    p.offset = offset;
+    p.bytesLeft = bytesLeft;
+    p.chunkSize = chunkSize;
+    p.hash = hash;
+    return txRun(&p);
+}
+
+// Send a pipe until it ends, as data packets from offset 0. Set *size to the
+// bytes sent and add them to hash. Return "0" on success or "-1" on error.
+int sendStream(int fd, long int chunkSize, HashState *hash, uint64_t *size) {
+    TxPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.fd = fd;
+    p.chunkSize = chunkSize;
+    p.hash = hash;
+    p.stream = TRUE;
+    int result = txRun(&p);
+    *size = p.streamed;
+    return result;
+}
+
+// Send the file compressed by a worker thread, which works on the next blocks
+// while the link sends the current one. Data packet offsets count stream bytes.
+// The file data is added to hash. Return "0" on success or "-1" on error.
+int sendCompressed(int fd, uint64_t size, long int chunkSize, HashState *hash, uint64_t *compressed) {
+    Compressor compressor;
+    if (compressorStart(&compressor, fd, size, options.compress, hash) == -1)
+        return -1;
+    if (llasyncStart(NULL, NULL) == -1) {
+        compressorFinish(&compressor);
+        return -1;
+    }
+
+    unsigned char header[DATA_HEADER_SIZE];
+    uint64_t offset = 0;
+    int failed = FALSE;
+    CompressedBlock *block;
+
+    while (!failed && (block = compressorNext(&compressor)) != NULL) {
+        for (size_t done = 0; !failed && done < block->size;) {
+            if (llasyncPending() >= TX_WINDOW) {
+                if (llasyncWait(-1) == -1)
+                    failed = TRUE;
+                continue;
+            }
+
+            // The link layer frames the packet at once, the block can be released after
+            long dataSize = block->size - done > (size_t) chunkSize ? chunkSize : (long) (block->size - done);
+            dataPacketHeader(header, offset, dataSize);
+            struct iovec iov[2] = {{header, DATA_HEADER_SIZE}, {block->data + done, dataSize}};
+            if (llwriteAsyncv(iov, 2, dataPacketSent, &failed) == -1)
+                failed = TRUE;
+            done += dataSize;
+            offset += dataSize;
+        }
+        compressorRelease(block);
+    }
+
+    while (!failed && llasyncPending() > 0)
+        if (llasyncWait(-1) == -1)
+            failed = TRUE;
+
+    *compressed = offset;
+    if (llasyncStop() == -1)
+        failed = TRUE;
+    if (compressorFinish(&compressor) == -1)
+        failed = TRUE;
+    return failed ? -1 : 0;
+}
+
+// Called from the write-behind thread when the file holds every byte before offset.
+void dataWritten(void *context, off_t offset) {
+    JournalState *state = (JournalState *) context;
+    if (state->journalFd == -1 || offset - state->journaled < JOURNAL_INTERVAL)
+        return;
+
+    state->journal.offset = offset;
+    if (saveJournal(state->journalFd, state->fd, &state->journal) == -1)
+        printf("Error saving the resume journal.\n");
+    state->journaled = offset;
+}
+
+// Send the signatures of the full blocks of the old copy of a file (oldFd, -1 if
+// there is none) in answer to a delta request. Return "0" or "-1".
+int sendSignatures(int oldFd, uint64_t oldSize) {
+    size_t blockSize = deltaBlockSize(oldSize);
+    uint64_t blocks = oldFd != -1 ? oldSize / blockSize : 0;
+
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    packet[0] = C_SIGNATURE;
+    int iter = writeNumberField(packet, 1, T_BLOCK, blockSize, numberLength(blockSize));
+    iter = writeNumberField(packet, iter, T_BLOCKS, blocks, numberLength(blocks));
+    if (llwrite(packet, iter) == -1)
+        return -1;
+
+    unsigned char *data = (unsigned char *) malloc(blockSize);
+    packet[0] = C_BLOCKS;
+    iter = 1;
+    for (uint64_t block = 0; block < blocks; block++) {
+        if (pread(oldFd, data, blockSize, block * blockSize) != (ssize_t) blockSize) {
+            free(data);
+            return -1;
+        }
+        putNumber(packet + iter, deltaWeak(data, blockSize), 4);
+        putNumber(packet + iter + 4, deltaStrong(data, blockSize), 8);
+        iter += DELTA_SIGNATURE_SIZE;
+
+        if (iter + DELTA_SIGNATURE_SIZE > MAX_PAYLOAD_SIZE || block + 1 == blocks) {
+            if (llwrite(packet, iter) == -1) {
+                free(data);
+                return -1;
+            }
+            iter = 1;
+        }
+    }
+
+    free(data);
+    return 0;
+}
+
+// Read the answer to a delta request. Return "0" or "-1".
+int receiveSignatures(DeltaSignature **signatures, int *count, size_t *blockSize) {
+    unsigned char packet[MAX_PAYLOAD_SIZE + 8];
+    int size = readReply(packet, C_SIGNATURE);
+    if (size == -1)
+        return -1;
+    uint64_t block = readNumberField(packet, size, T_BLOCK);
+    uint64_t blocks = readNumberField(packet, size, T_BLOCKS);
+
+    // The list is allocated before any signature arrives: the peer's numbers must
+    // be ones sendSignatures() can produce, and a copy must fit its length field
+    if (block < DELTA_MIN_BLOCK || block > UINT32_MAX || blocks > DELTA_MAX_BLOCKS) {
+        printf("Invalid block signatures: %" PRIu64 " blocks of %" PRIu64 " bytes.\n", blocks, block);
+        return -1;
+    }
+    *blockSize = block;
+    *count = (int) blocks;
+    *signatures = (DeltaSignature *) malloc((*count + 1) * sizeof(DeltaSignature));
+    if (*signatures == NULL)
+        return -1;
+
+    int received = 0;
+    while (received < *count) {
+        if ((size = readReply(packet, C_BLOCKS)) == -1)
+            return -1;
+        for (int i = 1; i + DELTA_SIGNATURE_SIZE <= size && received < *count; i += DELTA_SIGNATURE_SIZE) {
+            (*signatures)[received].weak = getNumber(packet + i, 4);
+            (*signatures)[received].strong = getNumber(packet + i + 4, 8);
+            received++;
+        }
+    }
+    return 0;
+}
+
+// Send a mapped file as copy instructions for the blocks the receiver already
+// has and data packets for the rest, through the transmit pipeline, and hash it
+// into hashState on the way. Add the data bytes sent to *literal. Return "0" or "-1".
+int sendDelta(const unsigned char *map, uint64_t size, long int chunkSize, const DeltaSignature *signatures,
+              int count, size_t blockSize, HashState *hashState, uint64_t *literal) {
+    DeltaIndex index;
+    if (deltaIndexBuild(&index, signatures, count) == -1)
+        return -1;
+
+    TxPipeline p;
+    memset(&p, 0, sizeof(p));
+    p.fd = -1;
+    p.map = map;
+    p.bytesLeft = size;
+    p.chunkSize = chunkSize;
+    p.delta = &index;
+    p.deltaBlockSize = blockSize;
+    p.hash = hashState;
+    int result = txRun(&p);
+    *literal += p.literal;
+
+    deltaIndexFree(&index);
+    return result;
+}
+
+// Copy length bytes of the old copy at source to offset of the new file.
+int copyOldData(int oldFd, uint64_t source, uint64_t offset, uint64_t length, WriteBehind *writeBehind,
+                HashState *hashState, uint64_t *hashed) {
+    unsigned char data[65536];
+    while (length > 0) {
+        size_t n = length > sizeof(data) ? sizeof(data) : length;
+        if (pread(oldFd, data, n, source) != (ssize_t) n)
+            return -1;
+        if (offset == *hashed) {
+            hashUpdate(hashState, data, n);
+            *hashed += n;
+        }
+        if (writeBehindWrite(writeBehind, offset, data, n) == -1)
+            return -1;
+        source += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Give back the preallocated blocks of the holes of a file: the regions never
+// written, which SEEK_HOLE reports as holes. Blocks past the end of the file
+// cannot be punched, so this runs once the file has its final size.
+void punchUnwritten(int fd, uint64_t size) {
+    off_t offset = 0;
+    while ((uint64_t) offset < size) {
+        off_t hole = lseek(fd, offset, SEEK_HOLE);
+        if (hole == -1 || (uint64_t) hole >= size)
+            break;
+        off_t data = lseek(fd, hole, SEEK_DATA);
+        if (data == -1)
+            data = size;
+        // File systems without holes fail here, the zeros just keep their blocks
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, hole, data - hole) == -1)
+            break;
+        offset = data;
+    }
+}
+
+// Receive pipeline: the link thread only runs llread() and queues the data
+// packets, a depacketizer thread checks them and hands the data to the
+// decompressor or the write-behind writer, so acknowledgements never wait
+// for hashing or copying.
+#define RX_PACKETS 64
+
+typedef struct {
+    int size;
+    unsigned char data[MAX_PAYLOAD_SIZE + 1];
+} RxPacket;
+
+typedef struct {
+    uint64_t size;
+    uint64_t chunkSize;
+    int oldFd;
+    Decompressor *decompressor; // NULL unless the data is a compressed stream
+    WriteBehind *writeBehind;
+    HashState *hash;
+    uint64_t received; // File bytes written (or copied) so far
+    uint64_t hashed;   // File bytes added to hash, in order
+    uint64_t streamed; // Compressed stream bytes fed to the decompressor
+    uint64_t holes;    // File bytes received as holes
+    int stream;        // Writing to a pipe: data in order only, holes written as zeros
+    RxPacket *packets;
+    SpscQueue full;  // Link -> depacketizer, NULL at the end
+    SpscQueue empty; // Depacketizer -> link
+    pthread_t thread;
+    atomic_int error;
+} Depacketizer;
+
+// Handle one data or copy packet. Return "0" or "-1" if it is invalid or cannot be written.
+int depacketize(Depacketizer *d, const unsigned char *packet, int packetSize) {
+    // Blocks of the old copy, for a delta
+    if (packet[0] == C_COPY) {
+        uint64_t offset = getNumber(packet + 1, 8);
+        uint64_t length = getNumber(packet + 17, 4);
+        if (d->oldFd == -1 || packetSize < COPY_PACKET_SIZE || offset + length > d->size
+            || copyOldData(d->oldFd, getNumber(packet + 9, 8), offset, length, d->writeBehind,
+                           d->hash, &d->hashed) == -1) {
+            printf("Invalid copy packet.\n");
+            return -1;
+        }
+        d->received += length;
+        telemetryProgress(length);
+        return 0;
+    }
+
+    // Zeros that were not sent. The region is never written (O_TRUNC, or past the
+    // resume offset), so it reads as zeros already.
+    if (packet[0] == C_HOLE) {
+        uint64_t offset = getNumber(packet + 1, 8);
+        uint64_t length = getNumber(packet + 9, 8);
+        // Repeated packet (a retransmission after a lost acknowledgement)
+        if (offset + length <= d->received)
+            return 0;
+        if (d->decompressor != NULL || packetSize < HOLE_PACKET_SIZE || offset + length > d->size
+            || offset + length < offset || (d->stream && offset > d->received)) {
+            printf("Invalid hole packet.\n");
+            return -1;
+        }
+        // A pipe cannot seek back, only the zeros it does not have yet are written
+        if (d->stream && offset < d->received) {
+            length -= d->received - offset;
+            offset = d->received;
+        }
+        if (offset == d->hashed) {
+            hashZeros(d->hash, length);
+            d->hashed += length;
+        }
+        // A pipe has no holes
+        static const unsigned char zeros[65536];
+        for (uint64_t done = 0; d->stream && done < length; done += sizeof(zeros)) {
+            size_t n = length - done > sizeof(zeros) ? sizeof(zeros) : length - done;
+            if (writeBehindWrite(d->writeBehind, offset + done, zeros, n) == -1)
+                return -1;
+        }
+        d->received += length;
+        d->holes += length;
+        telemetryProgress(length);
+        return 0;
+    }
+
+    // C_DATA packets follow the previous one, C_DATA_AT packets say where they go
+    uint64_t offset = d->received;
+    int header = 3;
+    if (packet[0] == C_DATA_AT) {
+        offset = getNumber(packet + 1, 8);
+        header = DATA_HEADER_SIZE;
+    }
+
+    // Assemble de size of the current packet
+    unsigned int current_size = packet[header - 2];
+
+    // Shift by 8 bits to make room for the low byte
+    current_size <<= 8;
+    current_size += packet[header - 1];
+
+    // Offsets of compressed data count stream bytes, which must arrive in order
+    if (d->decompressor != NULL) {
+        if (offset + current_size <= d->streamed)
+            return 0;
+        if (packetSize < header + (int) current_size || current_size > d->chunkSize || offset != d->streamed
+            || decompressorFeed(d->decompressor, packet + header, current_size) == -1) {
+            printf("Invalid compressed data.\n");
+            return -1;
+        }
+        d->streamed += current_size;
+        telemetryProgress(current_size);
+        return 0;
+    }
+
+    if (offset + current_size <= d->received)
+        return 0;
+    if (packetSize < header + (int) current_size || current_size > d->chunkSize
+        || offset + current_size > d->size || (d->stream && offset > d->received)) {
+        printf("Invalid data packet.\n");
+        return -1;
+    }
+
+    // Same for data: a pipe only gets the bytes it does not have yet
+    const unsigned char *data = packet + header;
+    if (d->stream && offset < d->received) {
+        data += d->received - offset;
+        current_size -= d->received - offset;
+        offset = d->received;
+    }
+
+    // Only in-order data can be hashed on the fly
+    if (offset == d->hashed) {
+        hashUpdate(d->hash, data, current_size);
+        d->hashed += current_size;
+    }
+
+    // Hand the data to the writer thread. The journal counts bytes, which
+    // assumes the transmitter sends the file in order.
+    if (writeBehindWrite(d->writeBehind, offset, data, current_size) == -1)
+        return -1;
+    d->received += current_size;
+    telemetryProgress(current_size);
+    return 0;
+}
+
+// Depacketizer thread. After an error the packets are only given back.
+static void *depacketizeWorker(void *arg) {
+    Depacketizer *d = (Depacketizer *) arg;
+    RxPacket *packet;
+    while ((packet = (RxPacket *) spscPop(&d->full)) != NULL) {
+        if (atomic_load(&d->error) == 0 && depacketize(d, packet->data, packet->size) == -1)
+            atomic_store(&d->error, 1);
+        spscPush(&d->empty, packet);
+    }
+    return NULL;
+}
+
+// Start the depacketizer thread. The other fields are filled in by the caller.
+// Return "0" on success or "-1" on error.
+int depacketizerStart(Depacketizer *d) {
+    atomic_init(&d->error, 0);
+    d->packets = (RxPacket *) malloc(RX_PACKETS * sizeof(RxPacket));
+    if (d->packets == NULL)
+        return -1;
+    // One extra slot in full for the final NULL
+    if (spscInit(&d->full, RX_PACKETS + 1) == -1) {
+        free(d->packets);
+        return -1;
+    }
+    if (spscInit(&d->empty, RX_PACKETS) == -1) {
+        spscDestroy(&d->full);
+        free(d->packets);
+        return -1;
+    }
+    for (int i = 0; i < RX_PACKETS; i++)
+        spscPush(&d->empty, &d->packets[i]);
+
+    if (pthread_create(&d->thread, NULL, depacketizeWorker, d) != 0) {
+        spscDestroy(&d->full);
+        spscDestroy(&d->empty);
+        free(d->packets);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the queued packets to be handled and stop the thread.
+// Return "0" on success or "-1" if a packet was rejected.
+int depacketizerFinish(Depacketizer *d) {
+    spscPush(&d->full, NULL);
+    pthread_join(d->thread, NULL);
+    spscDestroy(&d->full);
+    spscDestroy(&d->empty);
+    free(d->packets);
+    return atomic_load(&d->error) == 0 ? 0 : -1;
+}
+
+// Read the names of the files of a batch: the regular files of a directory, in
+// name order, or the lines of a list file. Return how many or -1 on error.
+int listFiles(const char *path, char ***files) {
+    struct stat st;
+    if (stat(path, &st) == -1)
+        return -1;
+
+    int count = 0, capacity = 16;
+    *files = (char **) malloc(capacity * sizeof(char *));
+
+    if (S_ISDIR(st.st_mode)) {
+        struct dirent **entries;
+        int n = scandir(path, &entries, NULL, alphasort);
+        if (n == -1)
+            return -1;
+        for (int i = 0; i < n; i++) {
+            char file[strlen(path) + strlen(entries[i]->d_name) + 2];
+            sprintf(file, "%s/%s", path, entries[i]->d_name);
+            if (stat(file, &st) == 0 && S_ISREG(st.st_mode)) {
+                if (count == capacity) {
+                    capacity *= 2;
+                    *files = (char **) realloc(*files, capacity * sizeof(char *));
+                }
+                (*files)[count++] = strdup(file);
+            }
+            free(entries[i]);
+        }
+        free(entries);
+        return count;
+    }
+
+    FILE *list = fopen(path, "r");
+    if (list == NULL)
+        return -1;
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t length;
+    while ((length = getline(&line, &lineSize, list)) != -1) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+            line[--length] = '\0';
+        if (length == 0)
+            continue;
+        if (count == capacity) {
+            capacity *= 2;
+            *files = (char **) realloc(*files, capacity * sizeof(char *));
+        }
+        (*files)[count++] = strdup(line);
+    }
+    free(line);
+    fclose(list);
+    return count;
+}
+
+// File bytes in each data packet, header included it must fit in MAX_PAYLOAD_SIZE
+long int dataChunkSize() {
+    long int chunkSize = MAX_PAYLOAD_SIZE - DATA_HEADER_SIZE;
+    if (options.payloadSize > 0 && options.payloadSize < chunkSize)
+        chunkSize = options.payloadSize;
+    return chunkSize;
+}
+
+// Send one file over an open connection: start packet, data packets and end packet.
+// In a batch (count > 0) the control packets carry the file index and count.
+// "-" sends stdin as a stream. Add the bytes sent to *sent. Return "0" on success
+// or "-1" on error.
+int sendFile(const char *filename, int index, int count, uint64_t *sent) {
+    // A stream has no size, name or metadata to send until it ends
+    int fromStdin = strcmp(filename, "-") == 0;
+    int fd = fromStdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd == -1) {
+        printf("Error opening \"%s\".\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        printf("Error reading \"%s\".\n", filename);
+        close(fd);
+        return -1;
+    }
+    uint64_t size = fromStdin ? 0 : (uint64_t) st.st_size;
+
+    // Resume needs the file identity and a resume request field
+    uint64_t hash = 0;
+    if (options.resume && hashFile(fd, &hash) == -1) {
+        printf("Error reading \"%s\".\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    long int chunkSize = dataChunkSize();
+
+    // The receiver has no use for our directories, only the name is sent
+    const char *name = strrchr(filename, '/');
+    name = name != NULL ? name + 1 : filename;
+    int nameLength = strlen(name);
+    if (nameLength > 255)
+        nameLength = 255;
+
+    // Start packet, sent again as the end packet with its first byte changed
+    unsigned char control_packet[MAX_PAYLOAD_SIZE];
+    int iter = 0;
+    control_packet[iter++] = C_START;
+    if (fromStdin) {
+        control_packet[iter++] = T_STREAM;
+        control_packet[iter++] = 0;
+    } else {
+        iter = writeNumberField(control_packet, iter, T_SIZE, size, numberLength(size));
+        control_packet[iter++] = T_NAME;
+        control_packet[iter++] = nameLength;
+        memcpy(control_packet + iter, name, nameLength);
+        iter += nameLength;
+    }
+    iter = writeNumberField(control_packet, iter, T_CHUNK, chunkSize, numberLength(chunkSize));
+    if (!fromStdin) {
+        iter = writeNumberField(control_packet, iter, T_MODE, st.st_mode & 07777, 2);
+        uint64_t mtime = (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        iter = writeNumberField(control_packet, iter, T_MTIME, mtime, 8);
+    }
+
+    if (count > 0) {
+        iter = writeNumberField(control_packet, iter, T_INDEX, index, numberLength(index));
+        iter = writeNumberField(control_packet, iter, T_COUNT, count, numberLength(count));
+    }
+
+    if (options.resume) {
+        iter = writeNumberField(control_packet, iter, T_HASH, hash, 8);
+        control_packet[iter++] = T_RESUME;
+        control_packet[iter++] = 0;
+    }
+
+    if (options.delta) {
+        control_packet[iter++] = T_DELTA;
+        control_packet[iter++] = 0;
+    }
+
+    if (options.compress)
+        iter = writeNumberField(control_packet, iter, T_COMPRESS, COMPRESS_ZLIB, 1);
+    int size_aux = iter;
+
+    if (count > 0)
+        printf("File %d/%d: %s, %" PRIu64 " bytes\n", index + 1, count, filename, size);
+    printf("Size of control packet: %d \n", size_aux);
+
+    // Write the control packet
+    if (llwrite(control_packet, size_aux) == -1) {
+        printf("Error transmitting information.1\n");
+        close(fd);
+        return -1;
+    }
+
+    // The receiver answers with the offset it has already verified
+    uint64_t offset = 0;
+    if (options.resume) {
+        unsigned char* reply = (unsigned char*)malloc(MAX_PAYLOAD_SIZE + 8);
+        int replySize = readReply(reply, C_RESUME);
+        if (replySize == -1) {
+            printf("No answer to the resume request.\n");
+            printf("Run again with --resume to continue from the last verified byte.\n");
+            free(reply);
+            close(fd);
+            return -1;
+        }
+        offset = readNumberField(reply, replySize, T_RESUME);
+        free(reply);
+
+        if (offset > size || lseek(fd, offset, SEEK_SET) == -1) {
+            printf("Invalid resume offset %" PRIu64 ".\n", offset);
+            close(fd);
+            return -1;
+        }
+        printf("Resuming from byte %" PRIu64 ".\n", offset);
+    }
+
+    // The receiver answers a delta request with the blocks of its old copy
+    DeltaSignature *signatures = NULL;
+    int blockCount = 0;
+    size_t blockSize = 0;
+    if (options.delta && receiveSignatures(&signatures, &blockCount, &blockSize) == -1) {
+        printf("Error receiving the block signatures.\n");
+        free(signatures);
+        close(fd);
+        return -1;
+    }
+
+    // An empty file cannot be mapped, it is sent without data packets anyway.
+    // A delta looks for blocks at every offset, it always needs the mapping.
+    unsigned char *map = NULL;
+    if ((options.mapFile || blockCount > 0) && size > 0) {
+        map = (unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("Error mapping \"%s\".\n", filename);
+            free(signatures);
+            close(fd);
+            return -1;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+    }
+
+    // A compressed stream is counted in stream bytes, its length is not known yet
+    telemetryFile(fromStdin ? "stdin" : filename, index, count > 0 ? count : 1,
+                  options.compress || fromStdin ? TELEMETRY_UNKNOWN : size, offset);
+
+    // Without resume the hash for the end packet is computed while the data is
+    // sent, the file is read only once
+    HashState stream;
+    hashInit(&stream, 0);
+
+    // Write content
     int result;
+    if (blockCount > 0) {
+        uint64_t literal = 0;
+        result = sendDelta(map, size, chunkSize, signatures, blockCount, blockSize, &stream, &literal);
+        printf("Delta: %" PRIu64 " bytes sent as data, %" PRIu64 " copied from %d blocks of %zu bytes.\n",
+               literal, size - literal, blockCount, blockSize);
+    } else if (fromStdin) {
+        result = sendStream(fd, chunkSize, &stream, &size);
+    } else if (options.compress) {
+        uint64_t compressed = 0;
+        result = sendCompressed(fd, size, chunkSize, &stream, &compressed);
+        printf("Compressed %" PRIu64 " bytes to %" PRIu64 " (%.2f:1).\n", size, compressed,
+               compressed > 0 ? (double) size / compressed : 1.0);
+    } else {
+        result = sendFileData(fd, map != NULL ? map + offset : NULL, offset, size - offset, chunkSize,
+                              options.resume ? NULL : &stream);
+    }
+    free(signatures);
+    if (map != NULL)
+        munmap(map, size);
+    close(fd);
 
-    if (strcmp(role, "tx") == 0) {
-        // Try to open file to read
-        int fd = open(filename, O_RDONLY);
-        if (fd == -1) {
-            printf("Error opening \"%s\".\n", filename);
-            return;
+    if (result == -1) {
+        printf("Failed transmitting data packet.\n");
+        if (options.resume)
+            printf("Run again with --resume to continue from the last verified byte.\n");
+        return -1;
+    }
+
+    // Set the first byt of the end packet. A stream only knows its size now.
+    control_packet[0] = C_END;
+    if (fromStdin)
+        size_aux = writeNumberField(control_packet, size_aux, T_SIZE, size, numberLength(size));
+    if (!options.resume)
+        size_aux = writeNumberField(control_packet, size_aux, T_HASH, hashDigest(&stream), 8);
+    if (llwrite(control_packet, size_aux) == -1) {
+        printf("Error transmitting information.3\n");
+        return -1;
+    }
+
+    *sent += size - offset;
+    return 0;
+}
+
+// Receive one file over an open connection into output, or into the directory
+// output under the name sent by the transmitter in batch mode, or into outputFd
+// (stdout) unless it is -1. Set *last when no other file follows.
+// Return "0" on success or "-1" on error.
+int receiveFile(unsigned char *buffer, const char *output, int outputFd, int *last) {
+    int packetSize = -1;
+    while ((packetSize = llread(buffer)) < 0 || buffer[0] != C_START);
+
+    // Read the size of the data from the start packet, a stream sends it at the end
+    uint64_t size = readNumberField(buffer, packetSize, T_SIZE);
+    uint64_t chunkSize = readNumberField(buffer, packetSize, T_CHUNK);
+    if (chunkSize == 0)
+        chunkSize = MAX_PAYLOAD_SIZE;
+    const unsigned char *value;
+    int resume = findField(buffer, packetSize, T_RESUME, &value) >= 0;
+    int unknownSize = findField(buffer, packetSize, T_STREAM, &value) >= 0;
+
+    // A batch names each file, which must stay inside the output directory
+    int batch = findField(buffer, packetSize, T_COUNT, &value) >= 0;
+    if (batch != options.batch) {
+        printf(batch ? "The transmitter sends a batch, run the receiver with --batch.\n"
+                     : "The transmitter sends a single file, run the receiver without --batch.\n");
+        return -1;
+    }
+
+    char filename[strlen(output) + 256 + 2];
+    strcpy(filename, output);
+    *last = TRUE;
+    uint64_t index = 0;
+    uint64_t count = 1;
+
+    if (batch) {
+        index = readNumberField(buffer, packetSize, T_INDEX);
+        count = readNumberField(buffer, packetSize, T_COUNT);
+        *last = index + 1 >= count;
+
+        int nameLength = findField(buffer, packetSize, T_NAME, &value);
+        char name[256];
+        if (nameLength > 0) {
+            memcpy(name, value, nameLength);
+            name[nameLength] = '\0';
         }
+        if (nameLength <= 0 || memchr(name, '/', nameLength) != NULL || memchr(name, '\0', nameLength) != NULL
+            || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            printf("Invalid file name in the start packet.\n");
+            return -1;
+        }
+        sprintf(filename, "%s/%s", output, name);
+        printf("File %" PRIu64 "/%" PRIu64 ": %s, %" PRIu64 " bytes\n", index + 1, count, filename, size);
+    }
 
-        // Get the file size and allocate a control packet with appropriate size.
+    // A delta is built in a new file from the old copy, which replaces it at the end
+    int oldFd = -1;
+    char newPath[strlen(filename) + 7];
+    strcpy(newPath, filename);
+    if (findField(buffer, packetSize, T_DELTA, &value) >= 0) {
         struct stat st;
-        if (stat(filename, &st) == -1) {
-            printf("Error allocating control packet");
-            return;
+        oldFd = outputFd == -1 ? open(filename, O_RDONLY) : -1;
+        if (oldFd != -1 && (fstat(oldFd, &st) == -1 || !S_ISREG(st.st_mode))) {
+            close(oldFd);
+            oldFd = -1;
+        }
+        if (sendSignatures(oldFd, oldFd != -1 ? (uint64_t) st.st_size : 0) == -1) {
+            printf("Error sending the block signatures of \"%s\".\n", filename);
+            return -1;
+        }
+        if (oldFd != -1)
+            sprintf(newPath, "%s.delta", filename);
+    }
+
+    // A resumed transfer keeps what a previous session already verified
+    int fd = outputFd != -1 ? outputFd : open(newPath, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    if (fd == -1) {
+        printf("Error opening \"%s\".\n", newPath);
+        return -1;
+    }
+
+    JournalState state;
+    state.journalFd = -1;
+    state.fd = fd;
+    state.journaled = 0;
+    ResumeJournal journal;
+    uint64_t received = 0;
+
+    char journalPath[strlen(filename) + 9];
+    sprintf(journalPath, "%s.journal", filename);
+
+    if (resume) {
+        // Nothing written to stdout can be kept, it starts from 0 without journal
+        if (outputFd == -1) {
+            uint64_t hash = readNumberField(buffer, packetSize, T_HASH);
+            struct stat st;
+            if (loadJournal(journalPath, &journal) == 0 && journal.size == size && journal.hash == hash
+                && fstat(fd, &st) == 0 && journal.offset <= (uint64_t) st.st_size) {
+                received = journal.offset;
+            }
+
+            journal.magic = JOURNAL_MAGIC;
+            journal.size = size;
+            journal.hash = hash;
+            journal.offset = received;
+            state.journal = journal;
+            state.journaled = received;
+
+            // Drop anything past the verified offset, it may be incomplete
+            state.journalFd = open(journalPath, O_WRONLY | O_CREAT, 0644);
+            if (state.journalFd == -1 || ftruncate(fd, received) == -1
+                || saveJournal(state.journalFd, fd, &journal) == -1) {
+                printf("Error opening \"%s\".\n", journalPath);
+                close(fd);
+                return -1;
+            }
         }
 
-        // Cast to unsigned long for size to avoid potential overflow with large files.
-        unsigned long size = (unsigned long) st.st_size;
+        unsigned char reply[1 + 2 + 8];
+        reply[0] = C_RESUME;
+        int replySize = writeNumberField(reply, 1, T_RESUME, received, 8);
+        if (llwrite(reply, replySize) == -1) {
+            printf("Error transmitting information.4\n");
+            close(fd);
+            return -1;
+        }
+        printf("Resuming from byte %" PRIu64 ".\n", received);
+    }
 
-        // Calculate L1 based on the size of the file.
-        int L1 = (int)ceil(log2(size) / 8 + 1);
+    // Reserve the whole file up front, so the blocks are allocated in one
+    // extent instead of one packet at a time. KEEP_SIZE leaves the visible
+    // size alone, an interrupted transfer does not look complete.
+    if (outputFd == -1 && size > received && fallocate(fd, FALLOC_FL_KEEP_SIZE, received, size - received) == -1)
+        printf("Could not preallocate \"%s\", writing it as it arrives.\n", filename);
 
-        // Calculate L2 based on the length of the filename.
-	    int L2 = strlen(filename);
+    // The data is hashed as it arrives, after what a previous session left on disk
+    HashState hashState;
+    hashInit(&hashState, 0);
+    uint64_t hashed = received;
+    if (received > 0 && hashFilePrefix(fd, received, &hashState) == -1) {
+        printf("Error reading \"%s\".\n", filename);
+        close(fd);
+        return -1;
+    }
 
-        // Calculate the total size needed for auxiliary control packet.
-        size_aux = 1 + 1 + 1 + L1 + 2 + L2;
+    // The disk is written from another thread, llread() never waits for it
+    WriteBehind writeBehind;
+    if (writeBehindStart(&writeBehind, fd, outputFd != -1 ? WRITE_BEHIND_STREAM : (off_t) received,
+                         (FsyncPolicy) options.fsyncPolicy,
+                         options.fsyncInterval, dataWritten, &state) == -1) {
+        printf("Error starting the file writer.\n");
+        close(fd);
+        return -1;
+    }
 
-        // Allocate the control packet with the calculated size.
-        unsigned char* control_packet = (unsigned char*)malloc(size_aux);
-        if (control_packet == NULL) {
-            printf("Error allocating control packet");
-            return;
+    // A compressed stream goes through a worker thread that inflates it in order
+    int compressed = findField(buffer, packetSize, T_COMPRESS, &value) >= 0;
+    Decompressor decompressor;
+    if (compressed && (readNumberField(buffer, packetSize, T_COMPRESS) != COMPRESS_ZLIB
+                       || decompressorStart(&decompressor, &writeBehind, &hashState) == -1)) {
+        printf("Unsupported compression in the start packet.\n");
+        writeBehindFinish(&writeBehind);
+        close(fd);
+        return -1;
+    }
+
+    telemetryFile(outputFd != -1 ? "stdout" : filename, index, count,
+                  compressed || unknownSize ? TELEMETRY_UNKNOWN : size, received);
+
+    // The link thread reads, the depacketizer checks and writes the data
+    Depacketizer depacketizer;
+    depacketizer.size = unknownSize ? UINT64_MAX : size;
+    depacketizer.chunkSize = chunkSize;
+    depacketizer.oldFd = oldFd;
+    depacketizer.decompressor = compressed ? &decompressor : NULL;
+    depacketizer.writeBehind = &writeBehind;
+    depacketizer.hash = &hashState;
+    depacketizer.received = received;
+    depacketizer.hashed = hashed;
+    depacketizer.streamed = 0;
+    depacketizer.holes = 0;
+    depacketizer.stream = outputFd != -1;
+    if (depacketizerStart(&depacketizer) == -1) {
+        printf("Error starting the receive pipeline.\n");
+        if (compressed)
+            decompressorFinish(&decompressor, &received);
+        writeBehindFinish(&writeBehind);
+        close(fd);
+        return -1;
+    }
+
+    int bytesRead = -1;
+    RxPacket *packet = NULL;
+
+    // Read the buffer
+    while (atomic_load(&depacketizer.error) == 0) {
+        if (packet == NULL)
+            packet = (RxPacket *) spscPop(&depacketizer.empty);
+
+        // Read until packet has no data
+        packet->size = llread(packet->data);
+        telemetryTick();
+        if (packet->size == -1) {
+            printf("Keep reading...\n");
+            continue;
+        }
+        if (packet->data[0] != C_DATA && packet->data[0] != C_DATA_AT && packet->data[0] != C_COPY
+            && packet->data[0] != C_HOLE) {
+            bytesRead = packet->size;
+            memcpy(buffer, packet->data, bytesRead);
+            break;
         }
+        spscPush(&depacketizer.full, packet);
+        packet = NULL;
+    }
 
-        // Initialize control packet
-        int iter = 0;
-        control_packet[iter++] = 2;
-        control_packet[iter++] = 0;
-        control_packet[iter++] = L1;
+    int failed = depacketizerFinish(&depacketizer) == -1;
+    received = depacketizer.received;
+    hashed = depacketizer.hashed;
+
+    // The decompressor writes and hashes the whole file, in order
+    if (compressed) {
+        if (decompressorFinish(&decompressor, &received) == -1) {
+            printf("Error decompressing \"%s\".\n", filename);
+            writeBehindFinish(&writeBehind);
+            close(fd);
+            return -1;
+        }
+        hashed = received;
+    }
+
+    if (writeBehindFinish(&writeBehind) == -1) {
+        printf("Error writing \"%s\".\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    // Check if the first byte indicates the end of data
+    if(failed || buffer[0] != C_END) {
+        printf("Error receiving information.\n");
+        close(fd);
+        return -1;
+    }
+
+    // Read the size of the data from the end packet
+    uint64_t new_size = readNumberField(buffer, bytesRead, T_SIZE);
+    if (unknownSize)
+        size = new_size;
+
+    // Compare the received data vs the expected data
+    if(new_size != size || received != size) {
+        printf("Size of packets not coincident.\n");
+        close(fd);
+        return -1;
+    }
+
+    // A file that ends with a hole is not extended to its size by any write
+    if (depacketizer.holes > 0 && outputFd == -1) {
+        if (ftruncate(fd, size) == -1) {
+            printf("Error writing \"%s\".\n", filename);
+            close(fd);
+            return -1;
+        }
+        punchUnwritten(fd, size);
+    }
+
+    // Verify the hash of the end packet. Data that arrived out of order is read back.
+    if (findField(buffer, bytesRead, T_HASH, &value) >= 0) {
+        if (hashed != size) {
+            hashInit(&hashState, 0);
+            if (outputFd != -1 || hashFilePrefix(fd, size, &hashState) == -1) {
+                printf("Error reading \"%s\".\n", filename);
+                close(fd);
+                return -1;
+            }
+        }
+
+        uint64_t expected = readNumberField(buffer, bytesRead, T_HASH);
+        uint64_t digest = hashDigest(&hashState);
+        if (digest != expected) {
+            printf("Hash mismatch in \"%s\": %016" PRIx64 ", expected %016" PRIx64 ".\n",
+                   filename, digest, expected);
+            // The journal cannot be trusted either, the next transfer starts over
+            if (state.journalFd != -1) {
+                close(state.journalFd);
+                unlink(journalPath);
+            }
+            close(fd);
+            return -1;
+        }
+        printf("Hash verified: %016" PRIx64 "\n", digest);
+    }
+
+    // Restore the metadata sent by the transmitter, the data is already written
+    if (outputFd == -1 && findField(buffer, bytesRead, T_MODE, &value) >= 0
+        && fchmod(fd, readNumberField(buffer, bytesRead, T_MODE) & 07777) == -1)
+        printf("Could not set the mode of \"%s\".\n", filename);
+    if (outputFd == -1 && findField(buffer, bytesRead, T_MTIME, &value) >= 0) {
+        uint64_t mtime = readNumberField(buffer, bytesRead, T_MTIME);
+        struct timespec times[2] = {{0, UTIME_OMIT}, {mtime / 1000000000, mtime % 1000000000}};
+        if (futimens(fd, times) == -1)
+            printf("Could not set the modification time of \"%s\".\n", filename);
+    }
 
-        // Insert the size into the control packet in a big-endian format.
-        int size_aux_aux= size_aux;
-        for (unsigned char i = 0 ; i < L1 ; i++) {
-            control_packet[2+L1-i] = size_aux_aux & 0xFF;
-            size_aux_aux >>= 8;
+    // The transfer is complete, nothing left to resume
+    if (state.journalFd != -1) {
+        close(state.journalFd);
+        unlink(journalPath);
+    }
+
+    close(fd);
+
+    // The old copy is only replaced once the new file is verified
+    if (oldFd != -1) {
+        close(oldFd);
+        if (rename(newPath, filename) == -1) {
+            printf("Error replacing \"%s\".\n", filename);
+            return -1;
         }
+    }
+    return 0;
+}
+
+void applicationLayer(const char *serialPort, const char *role, int baudRate,
+                      int nTries, double timeout, const char *filename)
+{
+    int result;
 
-        // Adjust 'i' to skip over the size bytes just written.
-        iter += L1;
-        control_packet[iter++] = 1;  // Type of file name field
-        control_packet[iter++] = L2; // Length of file name field
+    // "-" streams stdin (tx) or stdout (rx). The log goes to stderr, so that
+    // stdout only carries the data.
+    int streamFd = -1;
+    if (strcmp(filename, "-") == 0) {
+        fflush(stdout);
+        if (strcmp(role, "rx") == 0)
+            streamFd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
 
-        // Copy the filename into the control packet.
-        memcpy(control_packet + iter, filename, L2);
+    if (strcmp(role, "tx") == 0) {
+        // A batch is sent in one session, each file with its own start and end packets
+        char *single = (char *) filename;
+        char **files = &single;
+        int count = 1;
+        if (options.batch) {
+            count = listFiles(filename, &files);
+            if (count <= 0) {
+                printf("No files to send in \"%s\".\n", filename);
+                return;
+            }
+        }
 
         // Set connection parameters
         LinkLayer connectionParameters;
@@ -89,100 +1814,76 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         connectionParameters.nRetransmissions = nTries;
         connectionParameters.timeout = timeout;
 
+        // A saved profile applies from llopen() on, a new one once the line is probed
+        LinkProfile profile;
+        int tuned = options.tune == TuneSaved && loadProfile(serialPort, &profile) == 0;
+        if (tuned) {
+            connectionParameters.nRetransmissions = profile.nRetransmissions;
+            connectionParameters.timeout = profile.timeout;
+        }
+
+        // llstat can follow the transfer from now on
+        if (telemetryOpen(serialPort, role) == -1)
+            printf("Telemetry segment not available, llstat will not show this transfer.\n");
+
         // Open connection and handle error
         if (llopen(connectionParameters) == -1) {
             printf("Error setting connection.\n");
+            telemetryClose(TelemetryFailed);
             return;
         }
-        printf("Size of control packet: %d \n", size_aux);
-
-        // Write the control packet
-        int err= llwrite(control_packet, size_aux);
 
-        if (err ==-1) {
-            printf("Error transmitting information.1\n");
-            return;
-        }
-       
-        // Read response
-        unsigned char* content = (unsigned char*)malloc(sizeof(unsigned char) * size);  
-        read(fd, content, size);
-
-        long int bytesLeft = size;
-
-        // Write content
-        while (bytesLeft >= 0) {
-            printf("Bytes left to send: %li \n", bytesLeft);
-            // Determine the size of the data to send in this iteration. 
-            int dataSize = bytesLeft > (long int) MAX_PAYLOAD_SIZE ? MAX_PAYLOAD_SIZE : bytesLeft;
-            
-            // Allocate the memory for the data
-            unsigned char* data = (unsigned char*) malloc(dataSize);
-
-            // Copy datasyze bytes from the content to the buffer
-            memcpy(data, content, dataSize);
-
-            // Calculate packet size
-            int packetSize;
-            packetSize = 1 + 1 + 1 + dataSize;
-
-            // Allocate memory for the packet
-            unsigned char* packet = (unsigned char*)malloc(packetSize);
-
-            // Set header and data of the packet
-            packet[0] = 1;
-            packet[2] = dataSize & 0xFF;
-            packet[1] = (dataSize >> 8) & 0xFF;
-            memcpy(packet + 3, data, dataSize);
-           
-
-            // Write the data and handle error
-            if (llwrite(packet, packetSize) == -1) {
-                printf("Failed transmitting data packet.\n");
+        if (options.tune != TuneOff && !tuned) {
+            printf("Probing the line...\n");
+            if (tuneLink(&profile, MAX_PAYLOAD_SIZE - DATA_HEADER_SIZE) == -1) {
+                printf("Error probing the line.\n");
+                telemetryClose(TelemetryFailed);
                 return;
             }
-        
-            // Decrease bytes set and move the content pointer forward
-            bytesLeft -= (long int) MAX_PAYLOAD_SIZE; 
-            content += dataSize; 
+            llsetRetransmission(profile.nRetransmissions, profile.timeout);
+            if (saveProfile(serialPort, &profile) == -1)
+                printf("Could not save the profile of %s.\n", serialPort);
+            tuned = TRUE;
+        }
+        if (tuned) {
+            printf("Link profile: payload %d, timeout %.2f s, %d tries (line %.0f bit/s, "
+                   "round trip %.1f ms, byte error rate %.1e)\n",
+                   profile.payloadSize, profile.timeout, profile.nRetransmissions, profile.lineRate,
+                   profile.latency * 1e3, profile.byteErrorRate);
+            // --payload still wins over the profile
+            if (options.payloadSize == 0)
+                options.payloadSize = profile.payloadSize;
         }
 
-        // Set the first byt of the end packet
-        control_packet[0] = 3;
-
-        // Send the packet handle result
-        result = llwrite(control_packet, size_aux); 
-        if (result == -1) {
-            printf("Error transmitting information.3\n");
-            return;
-        } else {
-            result = llclose(TRUE);
+        double transferStart = monotonicSeconds();
+        uint64_t sent = 0;
+        for (int i = 0; i < count; i++) {
+            if (sendFile(files[i], i, options.batch ? count : 0, &sent) == -1) {
+                telemetryClose(TelemetryFailed);
+                return;
+            }
         }
+        printEfficiency(sent, monotonicSeconds() - transferStart, baudRate, dataChunkSize());
 
-        // Free the allocated memory
-        free(control_packet);
+        if (options.batch) {
+            printf("Sent %d files.\n", count);
+            for (int i = 0; i < count; i++)
+                free(files[i]);
+            free(files);
+        }
 
         // Check the result of the llclose() function
+        result = llclose(TRUE);
         if (result == -1) {
             printf("Error closing connection.\n");
+            telemetryClose(TelemetryFailed);
             return;
         }
-
-        close(fd);
+        telemetryClose(TelemetryDone);
     } else if (strcmp(role, "rx") == 0) {
-        int fd;
-        
-        // See whatt to do with the received file
-        int fd_temp = open(filename, O_WRONLY | O_TRUNC);
-        if(fd_temp == -1)
-            fd = open(filename, O_APPEND | O_CREAT | O_WRONLY);
-        else {
-            write(fd_temp, "", 0);
-            close(fd_temp);
-            fd = open(filename, O_APPEND | O_WRONLY);
-        }
-        if (fd == -1) {
-            printf("Error opening \"%s\".\n", filename);
+        // In batch mode filename is the directory the files are received into
+        if (options.batch && mkdir(filename, 0755) == -1 && errno != EEXIST) {
+            printf("Error creating \"%s\".\n", filename);
             return;
         }
 
@@ -195,78 +1896,39 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         connectionParameters.nRetransmissions = nTries;
         connectionParameters.timeout = timeout;
 
+        if (telemetryOpen(serialPort, role) == -1)
+            printf("Telemetry segment not available, llstat will not show this transfer.\n");
+
         // Open connection and hanlde error
         if (llopen(connectionParameters) == -1) {
             printf("Not opening the serial port.\n");
+            telemetryClose(TelemetryFailed);
             return;
         } 
-        unsigned char* buffer = (unsigned char*) malloc (MAX_PAYLOAD_SIZE);
-        int packetSize = -1;
-        while ((packetSize = llread(buffer)) < 0);
+        // Room for the packet header and the BCC2 appended by llread
+        unsigned char* buffer = (unsigned char*) malloc (MAX_PAYLOAD_SIZE + 8);
 
-        // Initialize a variable to hold the size of the data and loop over the next 8 bytes
-        unsigned long size = 0;
-        for (int i = 0; i < 8; i++) {
-            size <<= 8;
-            size += buffer[i + 3];
-        }
-
-        int bytesRead;
-
-        // Read the buffer
-        while(1) {
-            // Read until packet has no data
-            bytesRead = llread(buffer);
-            if(bytesRead == -1) {
-                printf("Keep reading...\n");
-                continue;
+        int last = FALSE;
+        int files = 0;
+        while (!last) {
+            if (receiveFile(buffer, filename, streamFd, &last) == -1) {
+                telemetryClose(TelemetryFailed);
+                return;
             }
-            if(buffer[0] != 1) break;
-
-            // Assemble de size of the current packet
-            unsigned int current_size = buffer[1];
-
-            // Shift by 8 bits to make room for the low byte
-            current_size <<= 8;
-            current_size += buffer[2];
-            
-            // Write data to the file descriptor
-            write(fd, buffer + 3, current_size);
-
-            printf("Bytes read: %i\n", bytesRead);
+            files++;
         }
+        if (options.batch)
+            printf("Received %d files.\n", files);
 
-        // Check if the first byte indicates the end of data
-        if(buffer[0] != 3) {
-            printf("Error receiving information.\n");
-            return;
-        }
-
-        // Start storing the data of the end packet
-        unsigned long new_size = 0;
-
-        // Loop and shift to make room for the next byte
-        for(int i = 0; i < 8; i++){
-            new_size <<= 8;
-            new_size += buffer[i + 3];
-        }
-        
-        // Compare the received data vs the expected data
-        if(new_size != size) {
-            printf("Size of packets not coincident.\n");
-            return;
-        }
-        
         // Free de memory form the buffer
         free(buffer);
         
         result = llclose(TRUE);
         if(result == -1) {
             printf("Error closing connection.\n");
+            telemetryClose(TelemetryFailed);
             return;
         }
-        close(fd);
-
+        telemetryClose(TelemetryDone);
     }
-    
 }
@@ -0,0 +1,246 @@
+// Compression pipeline implementation.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "compression.h"
+
+static void putNumber32(unsigned char *p, uint32_t number) {
+    p[0] = number >> 24;
+    p[1] = number >> 16;
+    p[2] = number >> 8;
+    p[3] = number;
+}
+
+static uint32_t getNumber32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int readAll(int fd, unsigned char *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pread(fd, buf, size, offset);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Compressor thread: read, hash and compress one block at a time. Blocks that
+// do not shrink are stored as they are. A NULL block ends the stream.
+static void *compressWorker(void *arg) {
+    Compressor *compressor = (Compressor *)arg;
+    unsigned char *input = (unsigned char *)malloc(COMPRESS_BLOCK_SIZE);
+    uLong bound = compressBound(COMPRESS_BLOCK_SIZE);
+    off_t offset = 0;
+
+    while (input != NULL && offset < compressor->size && !atomic_load(&compressor->stop)) {
+        size_t n = compressor->size - offset > COMPRESS_BLOCK_SIZE ? COMPRESS_BLOCK_SIZE
+                                                                 : (size_t)(compressor->size - offset);
+        CompressedBlock *block = (CompressedBlock *)malloc(sizeof(CompressedBlock));
+        if (block != NULL)
+            block->data = (unsigned char *)malloc(COMPRESS_HEADER_SIZE + bound);
+        if (block == NULL || block->data == NULL || readAll(compressor->fd, input, n, offset) == -1) {
+            if (block != NULL)
+                free(block->data);
+            free(block);
+            atomic_store(&compressor->error, 1);
+            break;
+        }
+        if (compressor->hash != NULL)
+            hashUpdate(compressor->hash, input, n);
+
+        uLongf stored = bound;
+        unsigned char type = COMPRESS_DEFLATE;
+        if (compress2(block->data + COMPRESS_HEADER_SIZE, &stored, input, n, compressor->level) != Z_OK
+            || stored >= n) {
+            type = COMPRESS_STORED;
+            memcpy(block->data + COMPRESS_HEADER_SIZE, input, n);
+            stored = n;
+        }
+        block->data[0] = type;
+        putNumber32(block->data + 1, n);
+        putNumber32(block->data + 5, stored);
+        block->size = COMPRESS_HEADER_SIZE + stored;
+
+        compressor->compressed += block->size;
+        spscPush(&compressor->queue, block);
+        offset += n;
+    }
+
+    if (offset < compressor->size)
+        atomic_store(&compressor->error, 1);
+    free(input);
+    spscPush(&compressor->queue, NULL);
+    return NULL;
+}
+
+int compressorStart(Compressor *compressor, int fd, off_t size, int level, HashState *hash)
+{
+    memset(compressor, 0, sizeof(*compressor));
+    compressor->fd = fd;
+    compressor->size = size;
+    compressor->level = level;
+    compressor->hash = hash;
+    atomic_init(&compressor->stop, 0);
+    atomic_init(&compressor->error, 0);
+
+    // One extra slot for the final NULL
+    if (spscInit(&compressor->queue, COMPRESS_QUEUE + 1) == -1)
+        return -1;
+    if (pthread_create(&compressor->thread, NULL, compressWorker, compressor) != 0) {
+        spscDestroy(&compressor->queue);
+        return -1;
+    }
+    return 0;
+}
+
+CompressedBlock *compressorNext(Compressor *compressor)
+{
+    // The worker pushes a single NULL, keep returning it without waiting again
+    if (compressor->drained)
+        return NULL;
+    CompressedBlock *block = (CompressedBlock *)spscPop(&compressor->queue);
+    if (block == NULL)
+        compressor->drained = 1;
+    return block;
+}
+
+void compressorRelease(CompressedBlock *block)
+{
+    free(block->data);
+    free(block);
+}
+
+int compressorFinish(Compressor *compressor)
+{
+    if (!compressor->drained) {
+        atomic_store(&compressor->stop, 1);
+        CompressedBlock *block;
+        while ((block = (CompressedBlock *)spscPop(&compressor->queue)) != NULL)
+            compressorRelease(block);
+    }
+    pthread_join(compressor->thread, NULL);
+    spscDestroy(&compressor->queue);
+    return atomic_load(&compressor->error) == 0 ? 0 : -1;
+}
+
+// Decompressor thread: inflate each block and hand it to the writer in order.
+static void *decompressWorker(void *arg) {
+    Decompressor *decompressor = (Decompressor *)arg;
+    unsigned char *output = (unsigned char *)malloc(COMPRESS_BLOCK_SIZE);
+    if (output == NULL)
+        atomic_store(&decompressor->error, 1);
+
+    CompressedBlock *block;
+    while ((block = (CompressedBlock *)spscPop(&decompressor->queue)) != NULL) {
+        if (atomic_load(&decompressor->error) == 0) {
+            unsigned char *data = block->data + COMPRESS_HEADER_SIZE;
+            uLongf original = getNumber32(block->data + 1);
+            uLong stored = getNumber32(block->data + 5);
+
+            if (block->data[0] == COMPRESS_DEFLATE) {
+                uLongf size = COMPRESS_BLOCK_SIZE;
+                if (uncompress(output, &size, data, stored) != Z_OK || size != original)
+                    atomic_store(&decompressor->error, 1);
+                data = output;
+            }
+
+            if (atomic_load(&decompressor->error) == 0) {
+                if (decompressor->hash != NULL)
+                    hashUpdate(decompressor->hash, data, original);
+                if (writeBehindWrite(decompressor->writeBehind, decompressor->written, data, original) == -1)
+                    atomic_store(&decompressor->error, 1);
+                decompressor->written += original;
+            }
+        }
+        compressorRelease(block);
+    }
+
+    free(output);
+    return NULL;
+}
+
+int decompressorStart(Decompressor *decompressor, WriteBehind *writeBehind, HashState *hash)
+{
+    memset(decompressor, 0, sizeof(*decompressor));
+    decompressor->writeBehind = writeBehind;
+    decompressor->hash = hash;
+    atomic_init(&decompressor->error, 0);
+
+    if (spscInit(&decompressor->queue, COMPRESS_QUEUE + 1) == -1)
+        return -1;
+    if (pthread_create(&decompressor->thread, NULL, decompressWorker, decompressor) != 0) {
+        spscDestroy(&decompressor->queue);
+        return -1;
+    }
+    return 0;
+}
+
+int decompressorFeed(Decompressor *decompressor, const unsigned char *data, size_t size)
+{
+    while (size > 0 && atomic_load(&decompressor->error) == 0) {
+        if (decompressor->current == NULL) {
+            size_t n = COMPRESS_HEADER_SIZE - decompressor->headerUsed;
+            if (n > size)
+                n = size;
+            memcpy(decompressor->header + decompressor->headerUsed, data, n);
+            decompressor->headerUsed += n;
+            data += n;
+            size -= n;
+            if (decompressor->headerUsed < COMPRESS_HEADER_SIZE)
+                break;
+
+            uint32_t original = getNumber32(decompressor->header + 1);
+            uint32_t stored = getNumber32(decompressor->header + 5);
+            if (decompressor->header[0] > COMPRESS_DEFLATE || original > COMPRESS_BLOCK_SIZE
+                || stored > compressBound(COMPRESS_BLOCK_SIZE)
+                || (decompressor->header[0] == COMPRESS_STORED && stored != original))
+                return -1;
+
+            CompressedBlock *block = (CompressedBlock *)malloc(sizeof(CompressedBlock));
+            if (block == NULL || (block->data = (unsigned char *)malloc(COMPRESS_HEADER_SIZE + stored)) == NULL) {
+                free(block);
+                return -1;
+            }
+            memcpy(block->data, decompressor->header, COMPRESS_HEADER_SIZE);
+            block->size = COMPRESS_HEADER_SIZE + stored;
+            decompressor->current = block;
+            decompressor->used = COMPRESS_HEADER_SIZE;
+        }
+
+        size_t n = decompressor->current->size - decompressor->used;
+        if (n > size)
+            n = size;
+        memcpy(decompressor->current->data + decompressor->used, data, n);
+        decompressor->used += n;
+        data += n;
+        size -= n;
+
+        if (decompressor->used == decompressor->current->size) {
+            spscPush(&decompressor->queue, decompressor->current);
+            decompressor->current = NULL;
+            decompressor->headerUsed = 0;
+        }
+    }
+
+    return atomic_load(&decompressor->error) == 0 ? 0 : -1;
+}
+
+int decompressorFinish(Decompressor *decompressor, uint64_t *written)
+{
+    // A block cut short means the stream is truncated
+    int truncated = decompressor->current != NULL || decompressor->headerUsed > 0;
+    if (decompressor->current != NULL)
+        compressorRelease(decompressor->current);
+
+    spscPush(&decompressor->queue, NULL);
+    pthread_join(decompressor->thread, NULL);
+    spscDestroy(&decompressor->queue);
+
+    *written = decompressor->written;
+    return !truncated && atomic_load(&decompressor->error) == 0 ? 0 : -1;
+}
@@ -0,0 +1,93 @@
+// Block delta implementation.
+
+#include <stdlib.h>
+#include "delta.h"
+#include "hash.h"
+
+size_t deltaBlockSize(uint64_t size)
+{
+    size_t blockSize = DELTA_MIN_BLOCK;
+    while ((uint64_t)blockSize * blockSize < size || size / blockSize > DELTA_MAX_BLOCKS)
+        blockSize *= 2;
+    return blockSize;
+}
+
+// Adler-style checksum as in rsync: a is the sum of the bytes, b the sum of the
+// running a values, both modulo 2^16
+uint32_t deltaWeak(const unsigned char *data, size_t size)
+{
+    uint32_t a = 0, b = 0;
+    for (size_t i = 0; i < size; i++) {
+        a += data[i];
+        b += (uint32_t)(size - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+uint32_t deltaRoll(uint32_t weak, unsigned char out, unsigned char in, size_t blockSize)
+{
+    uint32_t a = weak & 0xFFFF;
+    uint32_t b = weak >> 16;
+    a = (a - out + in) & 0xFFFF;
+    b = (b - (uint32_t)blockSize * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+uint64_t deltaStrong(const unsigned char *data, size_t size)
+{
+    HashState state;
+    hashInit(&state, 0);
+    hashUpdate(&state, data, size);
+    return hashDigest(&state);
+}
+
+static unsigned slotOf(uint32_t weak, unsigned mask)
+{
+    return (weak * 2654435761u) & mask;
+}
+
+int deltaIndexBuild(DeltaIndex *index, const DeltaSignature *signatures, int count)
+{
+    unsigned slots = 16;
+    while (slots < 2 * (unsigned)count)
+        slots *= 2;
+
+    index->signatures = signatures;
+    index->mask = slots - 1;
+    index->slots = (int *)calloc(slots, sizeof(int));
+    if (index->slots == NULL)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        unsigned slot = slotOf(signatures[i].weak, index->mask);
+        while (index->slots[slot] != 0)
+            slot = (slot + 1) & index->mask;
+        index->slots[slot] = i + 1;
+    }
+    return 0;
+}
+
+int deltaIndexFind(const DeltaIndex *index, uint32_t weak, const unsigned char *data, size_t size)
+{
+    int strongDone = 0;
+    uint64_t strong = 0;
+
+    for (unsigned slot = slotOf(weak, index->mask); index->slots[slot] != 0; slot = (slot + 1) & index->mask) {
+        int block = index->slots[slot] - 1;
+        if (index->signatures[block].weak != weak)
+            continue;
+        if (!strongDone) {
+            strong = deltaStrong(data, size);
+            strongDone = 1;
+        }
+        if (index->signatures[block].strong == strong)
+            return block;
+    }
+    return -1;
+}
+
+void deltaIndexFree(DeltaIndex *index)
+{
+    free(index->slots);
+    index->slots = NULL;
+}
@@ -0,0 +1,98 @@
+// Framing kernels implementation.
+
+#include "framing.h"
+
+unsigned char frameBcc(unsigned char bcc, const unsigned char *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        bcc ^= data[i];
+    return bcc;
+}
+
+size_t frameStuff(unsigned char *out, const unsigned char *data, size_t size, unsigned char *bcc)
+{
+    unsigned char xor = *bcc;
+    size_t j = 0;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char byte = data[i];
+        xor ^= byte;
+        if (byte == FRAME_FLAG || byte == FRAME_ESC) {
+            out[j++] = FRAME_ESC;
+            out[j++] = byte ^ FRAME_ESC_XOR;
+        } else {
+            out[j++] = byte;
+        }
+    }
+    *bcc = xor;
+    return j;
+}
+
+int frameDestuff(unsigned char *out, size_t capacity, const unsigned char *in, size_t size)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char byte = in[i];
+        if (byte == FRAME_ESC) {
+            if (++i == size)
+                return -1;
+            byte = in[i] ^ FRAME_ESC_XOR;
+        }
+        if (j == capacity)
+            return -1;
+        out[j++] = byte;
+    }
+    return (int) j;
+}
+
+int frameIsRepeat(unsigned char control, unsigned char nr)
+{
+    // N(s) is bit 6, the frame expected next has N(s) = nr ^ 1
+    return ((control >> 6) & 1) == nr;
+}
+
+void frameParserInit(FrameParser *parser, unsigned char *frame, int capacity)
+{
+    parser->frame = frame;
+    parser->capacity = capacity;
+    parser->size = 0;
+    parser->escaped = 0;
+    parser->overflow = 0;
+}
+
+int frameParse(FrameParser *parser, const unsigned char *bytes, int size, int *consumed)
+{
+    for (int i = 0; i < size; i++) {
+        unsigned char byte = bytes[i];
+
+        if (byte == FRAME_FLAG) {
+            int frameSize = parser->overflow || parser->escaped ? 0 : parser->size;
+            parser->size = 0;
+            parser->escaped = 0;
+            parser->overflow = 0;
+            // Back to back flags (closing and opening) are not a frame
+            if (frameSize > 0) {
+                *consumed = i + 1;
+                return frameSize;
+            }
+            continue;
+        }
+
+        if (byte == FRAME_ESC) {
+            parser->escaped = 1;
+            continue;
+        }
+
+        if (parser->escaped) {
+            byte ^= FRAME_ESC_XOR;
+            parser->escaped = 0;
+        }
+
+        if (parser->size == parser->capacity)
+            parser->overflow = 1;
+        else
+            parser->frame[parser->size++] = byte;
+    }
+
+    *consumed = size;
+    return 0;
+}
@@ -0,0 +1,188 @@
+// File hash implementation (XXH64, see github.com/Cyan4973/xxHash)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "hash.h"
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+#define HASH_FILE_CHUNK 65536
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little endian loads, independent of the host byte order
+static uint64_t read64(const unsigned char *p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+        value = (value << 8) | p[i];
+    return value;
+}
+
+static uint32_t read32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t mergeRound(uint64_t acc, uint64_t value) {
+    acc ^= round64(0, value);
+    return acc * PRIME1 + PRIME4;
+}
+
+// Consume one 32 byte stripe
+static void stripe(HashState *state, const unsigned char *p) {
+    state->acc[0] = round64(state->acc[0], read64(p));
+    state->acc[1] = round64(state->acc[1], read64(p + 8));
+    state->acc[2] = round64(state->acc[2], read64(p + 16));
+    state->acc[3] = round64(state->acc[3], read64(p + 24));
+}
+
+void hashInit(HashState *state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->acc[0] = seed + PRIME1 + PRIME2;
+    state->acc[1] = seed + PRIME2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME1;
+}
+
+void hashUpdate(HashState *state, const void *data, size_t size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + size;
+    state->totalSize += size;
+
+    // Complete the stripe left over from the previous call
+    if (state->pendingSize > 0) {
+        size_t missing = 32 - state->pendingSize;
+        if (size < missing) {
+            memcpy(state->pending + state->pendingSize, p, size);
+            state->pendingSize += size;
+            return;
+        }
+        memcpy(state->pending + state->pendingSize, p, missing);
+        stripe(state, state->pending);
+        state->pendingSize = 0;
+        p += missing;
+    }
+
+    while (end - p >= 32) {
+        stripe(state, p);
+        p += 32;
+    }
+
+    memcpy(state->pending, p, end - p);
+    state->pendingSize = end - p;
+}
+
+void hashZeros(HashState *state, uint64_t length)
+{
+    static const unsigned char zeros[32];
+
+    // Complete the pending stripe, then run the lanes without loading any data
+    size_t head = state->pendingSize > 0 ? 32 - state->pendingSize : 0;
+    if (head > length)
+        head = length;
+    hashUpdate(state, zeros, head);
+    length -= head;
+
+    uint64_t stripes = length / 32;
+    for (int i = 0; i < 4; i++) {
+        uint64_t acc = state->acc[i];
+        for (uint64_t n = 0; n < stripes; n++)
+            acc = ((acc << 31) | (acc >> 33)) * PRIME1;
+        state->acc[i] = acc;
+    }
+    state->totalSize += stripes * 32;
+
+    hashUpdate(state, zeros, length % 32);
+}
+
+uint64_t hashDigest(const HashState *state)
+{
+    uint64_t h;
+
+    if (state->totalSize >= 32) {
+        h = rotl(state->acc[0], 1) + rotl(state->acc[1], 7) + rotl(state->acc[2], 12) + rotl(state->acc[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = mergeRound(h, state->acc[i]);
+    } else {
+        h = state->seed + PRIME5;
+    }
+    h += state->totalSize;
+
+    const unsigned char *p = state->pending;
+    const unsigned char *end = p + state->pendingSize;
+
+    while (end - p >= 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+        p++;
+    }
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+int hashFilePrefix(int fd, off_t size, HashState *state)
+{
+    unsigned char *buffer = (unsigned char *)malloc(HASH_FILE_CHUNK);
+    if (buffer == NULL)
+        return -1;
+
+    off_t offset = 0;
+    while (size < 0 || offset < size) {
+        size_t chunk = HASH_FILE_CHUNK;
+        if (size >= 0 && size - offset < (off_t)chunk)
+            chunk = size - offset;
+        ssize_t n = pread(fd, buffer, chunk, offset);
+        if (n < 0 || (n == 0 && size >= 0)) {
+            free(buffer);
+            return -1;
+        }
+        if (n == 0)
+            break;
+        hashUpdate(state, buffer, n);
+        offset += n;
+    }
+
+    free(buffer);
+    return 0;
+}
+
+int hashFile(int fd, uint64_t *digest)
+{
+    HashState state;
+    hashInit(&state, 0);
+    if (hashFilePrefix(fd, -1, &state) == -1)
+        return -1;
+    *digest = hashDigest(&state);
+    return 0;
+}
@@ -1,17 +1,20 @@
 // Link layer protocol implementation
 
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <termios.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
 #include <stdbool.h>
 #include <math.h>
+#include "framing.h"
 #include "link_layer.h"
 
 // MISC
@@ -21,16 +24,15 @@
 #define TRUE 1
 #define MAX_PAYLOAD_SIZE 1000
 
-#define FLAG 0x7E
-#define ESC 0x7D
+#define FLAG FRAME_FLAG
 #define A_FSENDER 0x03
 #define A_FRECEIVER 0x01
 #define C_SET 0x03
 #define C_DISC 0x0B
 #define C_UA 0x07
-#define C_RR(n) ((n << 7) | 0x05) // Receiver Ready to receive 
-#define C_REJ(n) ((n << 7) | 0x01) // Receiver Rejects to receive
-#define C_INF(n) (n << 6) // Iframes to be sent
+#define C_RR(n) (((n) << 7) | 0x05) // Receiver Ready to receive 
+#define C_REJ(n) (((n) << 7) | 0x01) // Receiver Rejects to receive
+#define C_INF(n) ((n) << 6) // Iframes to be sent
 
 typedef enum {
 	START,
@@ -39,15 +41,15 @@ typedef enum {
 	C_RCV,
 	BCC1,
 	READING_DATA,
-	DATA_RECEIVED_ESC,
 	STOP
 } LinkLayerState;
 
 // Alarm variables
 volatile int alarmEnabled = FALSE;
 volatile int alarmCount = 0;
+int alarmReported = 0; // Timeouts already printed by reportAlarms
 int attempts = 0;
-int timeout = 0;
+double timeout = 0;
 
 int fd = 0; // Declare file descriptor globally
 
@@ -67,18 +69,76 @@ clock_t start, end;
 float cpuTotalTime = 0;
 
 int bytesSent = 0; // Bytes sent counter
+LinkLayerStats linkStats; // Frame counters reported by llstats
 bool waitingforUA =  FALSE; // Declare if the program is waiting for UA globally
 
 ////////////////////////////////////////////////
 // HELPER FUNCTIONS
 ////////////////////////////////////////////////
 
-// Alarm handler function
+// Alarm handler function. Only async-signal-safe work here, the timeout is
+// printed later by reportAlarms().
 void alarmHandler(int signal) {
     alarmEnabled = FALSE;
     alarmCount++;
-    printf("Alarm attempt #%d\n", alarmCount);
-    fflush(stdout);
+    linkStats.timeouts++;
+}
+
+// Arm SIGALRM after seconds, which may be a fraction (0 = cancel)
+void startAlarm(double seconds) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = (time_t) seconds;
+    timer.it_value.tv_usec = (suseconds_t) ((seconds - (time_t) seconds) * 1e6);
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// Print the timeouts counted by alarmHandler since the last call
+void reportAlarms() {
+    if (alarmCount < alarmReported)
+        alarmReported = 0;
+    while (alarmReported < alarmCount)
+        printf("Alarm attempt #%d\n", ++alarmReported);
+}
+
+double monotonicNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add a round-trip sample to the smoothed RTT (gain 1/8, as TCP's SRTT).
+// Only frames acknowledged on their first transmission are sampled.
+void updateRtt(double sample) {
+    linkStats.rtt = linkStats.rtt == 0 ? sample : linkStats.rtt + (sample - linkStats.rtt) / 8;
+}
+
+// Install the alarm handler without SA_RESTART, so a pending blocking read
+// returns when the alarm fires instead of waiting forever for the next byte
+void installAlarmHandler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = alarmHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGALRM, &action, NULL);
+}
+
+// Convert a baudrate in bits per second to its termios speed, B0 if unsupported
+speed_t baudRateToSpeed(int baudRate) {
+    switch (baudRate) {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 921600: return B921600;
+        default: return B0;
+    }
 }
 
 // Function to sptablish conection
@@ -97,7 +157,12 @@ int establishConnection(LinkLayer connectionParameters) {
 
     // Configure connection
     memset(&newtio, 0, sizeof(newtio));
-    newtio.c_cflag = connectionParameters.baudRate | CS8 | CLOCAL | CREAD;
+    speed_t speed = baudRateToSpeed(connectionParameters.baudRate);
+    if (speed == B0) {
+        printf("Unsupported baudrate %d\n", connectionParameters.baudRate);
+        return -1;
+    }
+    newtio.c_cflag = speed | CS8 | CLOCAL | CREAD;
     newtio.c_iflag = IGNPAR;
     newtio.c_oflag = 0;
     newtio.c_lflag = 0;
@@ -136,7 +201,7 @@ unsigned char readControlByte() {
     unsigned char controlByte = 0;
     LinkLayerState state = START;
 
-    while (state != STOP && (alarmEnabled == TRUE|| role == LlRx)) { 
+    while (state != STOP && alarmEnabled == TRUE) {
        
         if (read(fd, &byte, 1) > 0) {
             bytesSent++;
@@ -157,7 +222,8 @@ unsigned char readControlByte() {
                 break;
 
             case A_RCV:
-                if (byte == C_RR(0) || byte == C_RR(1) || byte == C_REJ(0) || byte == C_REJ(1)) {
+                if (byte == C_RR(0) || byte == C_RR(1) || byte == C_REJ(0) || byte == C_REJ(1)
+                    || byte == C_INF(0) || byte == C_INF(1)) {
                     state = C_RCV;
                     controlByte = byte;
                 } else if (byte != FLAG) {
@@ -168,7 +234,14 @@ unsigned char readControlByte() {
                 break;
 
             case C_RCV:
-                if (byte == (A_FSENDER ^ controlByte)) {
+                // The peer sends its last I-frame again when our RR for it was lost,
+                // and waits for that RR before it reads anything else
+                if (byte == (A_FSENDER ^ controlByte) && (controlByte == C_INF(0) || controlByte == C_INF(1))) {
+                    if (frameIsRepeat(controlByte, iFrameNumRx))
+                        sendSupervisionFrame(A_FSENDER, C_RR(iFrameNumRx ^ 1));
+                    controlByte = 0;
+                    state = START;
+                } else if (byte == (A_FSENDER ^ controlByte)) {
                     state = BCC1;
                 } else if (byte != FLAG) {
                     state = START;
@@ -294,7 +367,7 @@ int llopen(LinkLayer connectionParameters)
     startProcess = clock();
 
     // Start alarm handler
-    (void) signal(SIGALRM, alarmHandler);
+    installAlarmHandler();
 
     // Stablishing connection
     if (establishConnection(connectionParameters) < 0) {
@@ -315,9 +388,10 @@ int llopen(LinkLayer connectionParameters)
         while ((alarmCount < attempts) && state != STOP) {
             // Enable alarm
             if (alarmEnabled == FALSE) {
+                reportAlarms();
                 if(sendSupervisionFrame(A_FSENDER, C_SET) == -1)
                     return -1;
-                alarm(timeout);
+                startAlarm(timeout);
                 alarmEnabled = TRUE;
             }
             // Loop to read UA
@@ -375,6 +449,7 @@ int llopen(LinkLayer connectionParameters)
         }
         // End if attemps where exceded
         if(alarmCount == attempts && state != STOP) {
+            reportAlarms();
             return -1;
         }
     } else if (role == LlRx) {
@@ -453,73 +528,55 @@ int llopen(LinkLayer connectionParameters)
 ////////////////////////////////////////////////
 int llwrite(const unsigned char *buf, int bufSize)
 {
+    if (bufSize <= 0 || bufSize > MAX_PAYLOAD_SIZE)
+        return -1;
+
     // Set up alarm
     alarmCount=0;
     alarmEnabled=FALSE;
 
-    // Initialize frame
-    int frameSize = 6 + bufSize;
-    unsigned char *frame = (unsigned char *)malloc(frameSize);
+    // Initialize frame, room for every byte (and the BCC2) escaped
+    unsigned char *frame = (unsigned char *)malloc(6 + 2 * (bufSize + 1));
+    if (frame == NULL)
+        return -1;
     frame[0] = FLAG;
     frame[1] = A_FSENDER;
     frame[2] = C_INF(iFrameNumTx); 
     frame[3] = frame[1] ^ frame[2];
-    alarmEnabled=FALSE;
-    memcpy(frame + 4, buf, bufSize);
-    unsigned char BCC2 = buf[0];
-
-    // Fill frame
-    for (int i = 1; i < bufSize; i++) {
-        BCC2 ^= buf[i];
-    }
-
-    // Make new buffer and copy the contens of buf into it
-    unsigned char* bufwithbcc=(unsigned char*)malloc(bufSize+1);
-    memcpy(bufwithbcc, buf, bufSize);
-    bufwithbcc[bufSize]= BCC2;
 
+    // Fill frame: stuffed data, then the stuffed BCC2
     int j = 4;
-
-    // Set up frame
-    for (int i = 0; i < bufSize + 1; i++) {
-        if (bufwithbcc[i] == FLAG || bufwithbcc[i] == ESC)
-        {
-            frameSize= frameSize+1;
-            frame = realloc(frame,frameSize);
-            if(frame==NULL) {
-                return -1;
-            }
-            frame[j++] = ESC;
-            if(bufwithbcc[i] == FLAG){
-                frame[j++]=0x5E;
-            }
-            if(bufwithbcc[i] == ESC){
-                frame[j++]=0x5D;
-            }
-        }
-        else {
-            frame[j++] = bufwithbcc[i];
-        }
-    }
-
+    unsigned char BCC2 = 0;
+    j += frameStuff(frame + j, buf, bufSize, &BCC2);
+    unsigned char unused = 0;
+    j += frameStuff(frame + j, &BCC2, 1, &unused);
     frame[j++] = FLAG;
+    int frameSize = j;
 
     // Initialize accept/reject protocol
     int reject = 0;
     int accept = 0;
+    int transmissions = 0;
+    double sentAt = 0;
 
     // Loop and retry in case of error
     while (alarmCount< attempts) {
         if(alarmEnabled==FALSE){
+            reportAlarms();
         
-            alarm(timeout);
+            startAlarm(timeout);
             reject=0;
             accept=0; 
             alarmEnabled=TRUE;
 
+            if (transmissions++ > 0)
+                linkStats.retransmissions++;
+            linkStats.framesSent++;
+
             if(write(fd, frame, frameSize) == -1){
                 printf("Error writing.\n");
             }
+            sentAt = monotonicNow();
             
         }
       
@@ -534,12 +591,15 @@ int llwrite(const unsigned char *buf, int bufSize)
             // Retry if data was rejected
             else if(result == C_REJ(0) || result == C_REJ(1)){
                 reject = 1;
+                linkStats.rejects++;
             }
 
             // Set iframes if data was accepted
             else if (result == C_RR(0) || result == C_RR(1)){
                 accept = 1;
                 iFrameNumTx= (iFrameNumTx+1)%2;
+                if (transmissions == 1)
+                    updateRtt(monotonicNow() - sentAt);
             }
         }
         
@@ -550,6 +610,7 @@ int llwrite(const unsigned char *buf, int bufSize)
 
     // Delocate frame memory
     free(frame);
+    reportAlarms();
     
     if(accept == 1){
         return bufSize;
@@ -562,15 +623,30 @@ int llwrite(const unsigned char *buf, int bufSize)
 ////////////////////////////////////////////////
 // LLREAD
 ////////////////////////////////////////////////
-int llread(unsigned char *packet)
+// Read the next I-frame into packet, giving up at deadline (monotonicNow()
+// seconds) unless it is 0.
+static int readFrame(unsigned char *packet, double deadline)
 {
     unsigned char byte;
     char controlField;
-    int data_byte_counter=0;
+    // Stuffed payload and BCC2 as they arrive, destuffed when the closing flag comes
+    unsigned char stuffed[2 * (MAX_PAYLOAD_SIZE + 1)];
+    int stuffedSize = 0;
     clock_t startProcess, endProcess;
     startProcess = clock();
     LinkLayerState state = START;
     while (state!= STOP){
+        // Wait for the next byte only until the deadline
+        if (deadline > 0) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            int left = (int) ((deadline - monotonicNow()) * 1000);
+            int ready = left > 0 ? poll(&pfd, 1, left) : 0;
+            if (ready == 0)
+                return -1;
+            if (ready == -1)
+                continue;
+        }
+
         if(read(fd, &byte,1) >0) {
             bytesSent++;
 
@@ -625,54 +701,49 @@ int llread(unsigned char *packet)
                     if (controlField == 0x0B) {
                         return 0;
                     }
-                    if (byte == ESC) {
-                        state = DATA_RECEIVED_ESC;
-                    } else {
-                        state = READING_DATA; 
-                        packet[0] = byte; 
-                        data_byte_counter++;
-                    }
-                    break;
+                    state = READING_DATA;
+                    stuffedSize = 0;
+                    // fall through
 
                 case READING_DATA:
-                    if (byte == ESC) {
-                        state = DATA_RECEIVED_ESC;
+                    if (byte != FLAG) {
+                        // Payload and BCC2 never exceed MAX_PAYLOAD_SIZE + 1 bytes, a longer
+                        // frame is corrupted (a lost flag) and must not overrun packet
+                        if (stuffedSize == sizeof(stuffed)) {
+                            state = START;
+                            break;
+                        }
+                        stuffed[stuffedSize++] = byte;
                         break;
                     }
-                    if (byte== FLAG) {
-                        unsigned char bcc2 = packet[data_byte_counter-1];
-                        unsigned char accumulator = 0;
-                        data_byte_counter--;
-                        packet[data_byte_counter] ='\0';
-                        for (int i =0; i <=data_byte_counter; i++) {
-                            accumulator=(accumulator ^ packet[i]);
-                        }
-                        if (bcc2 == accumulator) {
-                            state = STOP;
-                            sendSupervisionFrame(A_FSENDER, C_RR(iFrameNumRx));
-                            iFrameNumRx = (iFrameNumRx + 1) % 2;
-                            alarm(0);
 
-                            endProcess = clock();
-                            cpuTotalTime += ((double) (endProcess - startProcess)) / (double) CLOCKS_PER_SEC;
-                            return data_byte_counter;
-                        } else {
+                    int size = frameDestuff(packet, MAX_PAYLOAD_SIZE + 1, stuffed, stuffedSize);
+                    if (size == -1) {
+                        // Too long once destuffed: corrupted as well
+                        state = FLAG_RCV;
+                        break;
+                    }
+                    // Duplicate of the frame accepted last: its RR was lost, so send it again
+                    if (frameIsRepeat(controlField, iFrameNumRx)) {
+                        sendSupervisionFrame(A_FSENDER, C_RR(iFrameNumRx ^ 1));
+                        state = FLAG_RCV;
+                        break;
+                    }
+                    if (size > 0 && frameBcc(0, packet, size - 1) == packet[size - 1]) {
+                        state = STOP;
+                        sendSupervisionFrame(A_FSENDER, C_RR(iFrameNumRx));
+                        linkStats.framesReceived++;
+                        iFrameNumRx = (iFrameNumRx + 1) % 2;
+                        alarm(0);
+
+                        endProcess = clock();
+                        cpuTotalTime += ((double) (endProcess - startProcess)) / (double) CLOCKS_PER_SEC;
+                        return size - 1;
+                    } else {
                         printf("Sending REJ\n");
                         sendSupervisionFrame(A_FSENDER, C_REJ(iFrameNumRx));
+                        linkStats.framesRejected++;
                         return -1;
-                        }
-                    } else {
-                        packet[data_byte_counter++] = byte;
-                    }
-                    break;
-
-                case DATA_RECEIVED_ESC:
-                    state = READING_DATA;
-                    if(byte == 0X5E) {
-                        packet[data_byte_counter++] = FLAG;
-                    }
-                    if (byte == 0x5D) {
-                        packet[data_byte_counter++] = ESC;
                     }
                     break;
 
@@ -685,6 +756,38 @@ int llread(unsigned char *packet)
     return -1;
 }
 
+int llread(unsigned char *packet)
+{
+    return readFrame(packet, 0);
+}
+
+int llreadTimeout(unsigned char *packet, double seconds)
+{
+    return readFrame(packet, monotonicNow() + seconds);
+}
+
+double llreplyTimeout()
+{
+    return attempts * timeout;
+}
+
+////////////////////////////////////////////////
+// LLSETRETRANSMISSION
+////////////////////////////////////////////////
+void llsetRetransmission(int nRetransmissions, double newTimeout)
+{
+    attempts = nRetransmissions;
+    timeout = newTimeout;
+}
+
+////////////////////////////////////////////////
+// LLSTATS
+////////////////////////////////////////////////
+void llstats(LinkLayerStats *stats)
+{
+    *stats = linkStats;
+}
+
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
@@ -696,15 +799,16 @@ int llclose(int showStatistics)
     alarmEnabled = FALSE;
     LinkLayerState state = START;
     unsigned char byte;
-    (void) signal(SIGALRM,alarmHandler);
+    installAlarmHandler();
 
     if (role == LlTx) {
         startProcessTx = clock();
 
         while (state != STOP &&  (alarmCount < attempts)) {
             if (alarmEnabled == FALSE) {
+                reportAlarms();
                 sendSupervisionFrame(A_FSENDER, C_DISC);
-                alarm(timeout);
+                startAlarm(timeout);
                 alarmEnabled = TRUE;
             }
             if (alarmEnabled == TRUE) {
@@ -812,5 +916,6 @@ int llclose(int showStatistics)
             }
         }
     }
+    reportAlarms();
     return -1;
 }
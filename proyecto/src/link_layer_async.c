@@ -0,0 +1,500 @@
+// Asynchronous link layer implementation.
+// Same frames as llwrite / llread, but the serial port is non-blocking and the
+// retransmission timer is a timerfd, so everything can be multiplexed through
+// one epoll descriptor owned by the caller's event loop.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include "framing.h"
+#include "link_layer.h"
+#include "link_layer_async.h"
+
+#define FLAG FRAME_FLAG
+#define A_FSENDER 0x03
+#define A_FRECEIVER 0x01
+#define C_DISC 0x0B
+#define C_RR(n) (((n) << 7) | 0x05)
+#define C_REJ(n) (((n) << 7) | 0x01)
+#define C_INF(n) ((n) << 6)
+
+#define READ_CHUNK 4096
+
+// Link state shared with link_layer.c
+extern int fd;
+extern int attempts;
+extern double timeout;
+extern unsigned char iFrameNumTx;
+extern unsigned char iFrameNumRx;
+extern int bytesSent;
+extern float cpuTotalTime;
+extern bool waitingforUA;
+extern LinkLayerStats linkStats;
+void updateRtt(double sample);
+double monotonicNow();
+
+typedef struct {
+    unsigned char *frame;
+    int frameSize;
+    int bufSize;
+    LlWriteCallback onWrite;
+    void *context;
+} PendingFrame;
+
+static int epollFd = -1;
+static int timerFd = -1;
+static int oldFlags = 0;
+
+static LlReadCallback readCallback = NULL;
+static void *readCallbackContext = NULL;
+
+// Circular queue of frames, the head is the one on the wire
+static PendingFrame queue[LL_ASYNC_QUEUE_SIZE];
+static int queueHead = 0;
+static int queueCount = 0;
+static int headOffset = -1; // Bytes of the head frame already written, -1 if not sent yet
+static int headTries = 0;
+static double headSentAt = 0; // When the last byte of the head frame was written
+static bool wantOutput = FALSE;
+
+// Receiver state: destuffed bytes between two flags
+static unsigned char rxFrame[2 * MAX_PAYLOAD_SIZE + 8];
+static FrameParser rxParser;
+
+static void sendSupervision(unsigned char A, unsigned char C) {
+    unsigned char frame[5] = {FLAG, A, C, A ^ C, FLAG};
+    // Supervision frames are tiny, a full output buffer just loses them like noise would
+    if (write(fd, frame, 5) != 5) {
+        return;
+    }
+}
+
+static int updateEpoll() {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | (wantOutput ? EPOLLOUT : 0);
+    event.data.fd = fd;
+    return epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+}
+
+static void armTimer(double seconds) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t) seconds;
+    spec.it_value.tv_nsec = (long) ((seconds - (time_t) seconds) * 1e9);
+    timerfd_settime(timerFd, 0, &spec, NULL);
+}
+
+// Write as much of the head frame as the port accepts
+static int flushHead() {
+    if (queueCount == 0)
+        return 0;
+
+    PendingFrame *head = &queue[queueHead];
+    if (headOffset < 0) {
+        head->frame[2] = C_INF(iFrameNumTx);
+        head->frame[3] = head->frame[1] ^ head->frame[2];
+        headOffset = 0;
+        if (headTries++ > 0)
+            linkStats.retransmissions++;
+        linkStats.framesSent++;
+    }
+
+    bool written = headOffset == head->frameSize;
+    while (headOffset < head->frameSize) {
+        int n = write(fd, head->frame + headOffset, head->frameSize - headOffset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        headOffset += n;
+    }
+
+    bool blocked = headOffset < head->frameSize;
+    if (blocked != wantOutput) {
+        wantOutput = blocked;
+        if (updateEpoll() == -1)
+            return -1;
+    }
+
+    // The timeout only starts once the whole frame is on the wire
+    if (!blocked) {
+        if (!written)
+            headSentAt = monotonicNow();
+        armTimer(timeout);
+    }
+
+    return 0;
+}
+
+// Remove the head frame and run its callback
+static int completeHead(int result) {
+    PendingFrame head = queue[queueHead];
+    queueHead = (queueHead + 1) % LL_ASYNC_QUEUE_SIZE;
+    queueCount--;
+    headOffset = -1;
+    headTries = 0;
+    armTimer(0);
+
+    free(head.frame);
+    if (head.onWrite != NULL)
+        head.onWrite(head.context, result == -1 ? -1 : head.bufSize);
+
+    if (flushHead() == -1)
+        return -1;
+    return 1;
+}
+
+// Send the head frame again, or give up after the configured number of tries
+static int retransmitHead() {
+    if (queueCount == 0 || headOffset < queue[queueHead].frameSize)
+        return 0;
+
+    if (headTries >= attempts) {
+        printf("Frame dropped after %d attempts\n", headTries);
+        return completeHead(-1);
+    }
+
+    headOffset = -1;
+    return flushHead();
+}
+
+// Handle a complete frame (without flags). Return the number of callbacks run.
+static int handleFrame(const unsigned char *frame, int size) {
+    if (size < 3 || (frame[0] ^ frame[1]) != frame[2])
+        return 0;
+
+    unsigned char C = frame[1];
+
+    // Supervision frames
+    if (size == 3) {
+        if (C == C_DISC && frame[0] == A_FSENDER) {
+            // Answer like llclose would, so it only has to wait for the UA
+            sendSupervision(A_FRECEIVER, C_DISC);
+            waitingforUA = TRUE;
+            if (readCallback != NULL) {
+                readCallback(readCallbackContext, NULL, 0);
+                return 1;
+            }
+            return 0;
+        }
+
+        if (queueCount == 0 || headOffset < queue[queueHead].frameSize)
+            return 0;
+
+        if (C == C_RR((iFrameNumTx + 1) % 2)) {
+            iFrameNumTx = (iFrameNumTx + 1) % 2;
+            if (headTries == 1)
+                updateRtt(monotonicNow() - headSentAt);
+            return completeHead(queue[queueHead].bufSize);
+        }
+        if (C == C_REJ(0) || C == C_REJ(1)) {
+            linkStats.rejects++;
+            if (retransmitHead() == -1)
+                return -1;
+        }
+        return 0;
+    }
+
+    // Information frames
+    if (frame[0] != A_FSENDER || (C != C_INF(0) && C != C_INF(1)))
+        return 0;
+
+    const unsigned char *data = frame + 3;
+    int dataSize = size - 4;
+    unsigned char bcc2 = frameBcc(0, data, dataSize);
+
+    // Duplicate of a frame already delivered: its RR was lost
+    if (frameIsRepeat(C, iFrameNumRx)) {
+        sendSupervision(A_FSENDER, C_RR(iFrameNumRx ^ 1));
+        return 0;
+    }
+
+    if (bcc2 != frame[size - 1]) {
+        sendSupervision(A_FSENDER, C_REJ(iFrameNumRx));
+        linkStats.framesRejected++;
+        return 0;
+    }
+
+    sendSupervision(A_FSENDER, C_RR(iFrameNumRx));
+    iFrameNumRx = (iFrameNumRx + 1) % 2;
+    linkStats.framesReceived++;
+
+    if (readCallback != NULL) {
+        readCallback(readCallbackContext, data, dataSize);
+        return 1;
+    }
+    return 0;
+}
+
+// Feed received bytes through the destuffing parser
+static int receiveBytes(const unsigned char *bytes, int size) {
+    int events = 0;
+
+    while (size > 0) {
+        int consumed;
+        int frameSize = frameParse(&rxParser, bytes, size, &consumed);
+        if (frameSize > 0) {
+            int n = handleFrame(rxParser.frame, frameSize);
+            if (n == -1)
+                return -1;
+            events += n;
+        }
+        bytes += consumed;
+        size -= consumed;
+    }
+
+    return events;
+}
+
+////////////////////////////////////////////////
+// LLASYNCSTART
+////////////////////////////////////////////////
+int llasyncStart(LlReadCallback onRead, void *readContext)
+{
+    if (epollFd != -1)
+        return epollFd;
+
+    // Retransmissions are driven by the timerfd from now on
+    alarm(0);
+
+    oldFlags = fcntl(fd, F_GETFL);
+    if (oldFlags == -1 || fcntl(fd, F_SETFL, oldFlags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epollFd == -1 || timerFd == -1) {
+        perror("epoll");
+        llasyncStop();
+        return -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        llasyncStop();
+        return -1;
+    }
+    event.data.fd = timerFd;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event) == -1) {
+        perror("epoll_ctl");
+        llasyncStop();
+        return -1;
+    }
+
+    readCallback = onRead;
+    readCallbackContext = readContext;
+    queueHead = 0;
+    queueCount = 0;
+    headOffset = -1;
+    headTries = 0;
+    wantOutput = FALSE;
+    frameParserInit(&rxParser, rxFrame, sizeof(rxFrame));
+
+    return epollFd;
+}
+
+int llasyncFd()
+{
+    return epollFd;
+}
+
+int llasyncPending()
+{
+    return queueCount;
+}
+
+////////////////////////////////////////////////
+// LLWRITEASYNC
+////////////////////////////////////////////////
+int llwriteAsync(const unsigned char *buf, int bufSize, LlWriteCallback onWrite, void *context)
+{
+    struct iovec iov = {(void *)buf, bufSize};
+    return llwriteAsyncv(&iov, 1, onWrite, context);
+}
+
+int llwriteAsyncv(const struct iovec *iov, int iovCount, LlWriteCallback onWrite, void *context)
+{
+    if (epollFd == -1 || queueCount == LL_ASYNC_QUEUE_SIZE)
+        return -1;
+
+    LlFrame *frame = llframe(iov, iovCount);
+    if (frame == NULL)
+        return -1;
+    return llwriteAsyncFrame(frame, onWrite, context);
+}
+
+LlFrame *llframe(const struct iovec *iov, int iovCount)
+{
+    int bufSize = 0;
+    for (int k = 0; k < iovCount; k++)
+        bufSize += iov[k].iov_len;
+
+    if (bufSize <= 0 || bufSize > MAX_PAYLOAD_SIZE)
+        return NULL;
+
+    // Worst case every byte (and the BCC2) is escaped
+    LlFrame *frame = (LlFrame *)malloc(sizeof(LlFrame));
+    if (frame == NULL)
+        return NULL;
+    frame->data = (unsigned char *)malloc(6 + 2 * (bufSize + 1));
+    if (frame->data == NULL) {
+        free(frame);
+        return NULL;
+    }
+
+    // Control field and BCC1 are filled in when the frame is sent
+    unsigned char *data = frame->data;
+    data[0] = FLAG;
+    data[1] = A_FSENDER;
+
+    // Stuffing is the only pass over the data, straight from the caller's buffers
+    int j = 4;
+    unsigned char BCC2 = 0;
+    for (int k = 0; k < iovCount; k++)
+        j += frameStuff(data + j, (const unsigned char *)iov[k].iov_base, iov[k].iov_len, &BCC2);
+    unsigned char unused = 0;
+    j += frameStuff(data + j, &BCC2, 1, &unused);
+    data[j++] = FLAG;
+
+    frame->size = j;
+    frame->bufSize = bufSize;
+    return frame;
+}
+
+void llframeFree(LlFrame *frame)
+{
+    free(frame->data);
+    free(frame);
+}
+
+int llwriteAsyncFrame(LlFrame *frame, LlWriteCallback onWrite, void *context)
+{
+    if (epollFd == -1 || queueCount == LL_ASYNC_QUEUE_SIZE) {
+        llframeFree(frame);
+        return -1;
+    }
+
+    int bufSize = frame->bufSize;
+    PendingFrame *entry = &queue[(queueHead + queueCount) % LL_ASYNC_QUEUE_SIZE];
+    entry->frame = frame->data;
+    entry->frameSize = frame->size;
+    entry->bufSize = bufSize;
+    entry->onWrite = onWrite;
+    entry->context = context;
+    queueCount++;
+    free(frame);
+
+    if (queueCount == 1 && flushHead() == -1)
+        return -1;
+
+    return bufSize;
+}
+
+////////////////////////////////////////////////
+// LLPROCESS
+////////////////////////////////////////////////
+int llprocess()
+{
+    if (epollFd == -1)
+        return -1;
+
+    clock_t startProcess = clock();
+    int events = 0;
+
+    // Retransmission timeout
+    unsigned long long expirations = 0;
+    if (read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations) && expirations > 0) {
+        linkStats.timeouts++;
+        int n = retransmitHead();
+        if (n == -1)
+            return -1;
+        events += n;
+    }
+
+    // Pending output of a partially written frame
+    if (wantOutput && flushHead() == -1)
+        return -1;
+
+    // Incoming bytes
+    unsigned char bytes[READ_CHUNK];
+    while (epollFd != -1) {
+        int n = read(fd, bytes, READ_CHUNK);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        if (n == 0)
+            break;
+
+        bytesSent += n;
+        int handled = receiveBytes(bytes, n);
+        if (handled == -1)
+            return -1;
+        events += handled;
+    }
+
+    cpuTotalTime += ((double) (clock() - startProcess)) / (double) CLOCKS_PER_SEC;
+
+    return events;
+}
+
+int llasyncWait(int timeoutMs)
+{
+    if (epollFd == -1)
+        return -1;
+
+    struct epoll_event events[2];
+    if (epoll_wait(epollFd, events, 2, timeoutMs) == -1 && errno != EINTR)
+        return -1;
+
+    return llprocess();
+}
+
+////////////////////////////////////////////////
+// LLASYNCSTOP
+////////////////////////////////////////////////
+int llasyncStop()
+{
+    while (queueCount > 0) {
+        free(queue[queueHead].frame);
+        queueHead = (queueHead + 1) % LL_ASYNC_QUEUE_SIZE;
+        queueCount--;
+    }
+    headOffset = -1;
+    headTries = 0;
+    readCallback = NULL;
+
+    if (timerFd != -1)
+        close(timerFd);
+    if (epollFd != -1)
+        close(epollFd);
+    timerFd = -1;
+    epollFd = -1;
+
+    if (fcntl(fd, F_SETFL, oldFlags) == -1) {
+        perror("fcntl");
+        return -1;
+    }
+
+    return 1;
+}
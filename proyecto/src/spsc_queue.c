@@ -0,0 +1,76 @@
+// Single-producer single-consumer queue implementation.
+
+#include <errno.h>
+#include <stdlib.h>
+#include "spsc_queue.h"
+
+int spscInit(SpscQueue *queue, unsigned capacity)
+{
+    unsigned size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    queue->slots = (void **)calloc(size, sizeof(void *));
+    if (queue->slots == NULL)
+        return -1;
+    queue->capacity = size;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+
+    // items counts the filled slots and space the free ones, each side takes one before using a slot
+    if (sem_init(&queue->items, 0, 0) == -1 || sem_init(&queue->space, 0, size) == -1) {
+        free(queue->slots);
+        return -1;
+    }
+    return 0;
+}
+
+void spscDestroy(SpscQueue *queue)
+{
+    sem_destroy(&queue->items);
+    sem_destroy(&queue->space);
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+static void put(SpscQueue *queue, void *item) {
+    unsigned tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    queue->slots[tail & (queue->capacity - 1)] = item;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    sem_post(&queue->items);
+}
+
+static void *take(SpscQueue *queue) {
+    unsigned head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    void *item = queue->slots[head & (queue->capacity - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    sem_post(&queue->space);
+    return item;
+}
+
+int spscTryPush(SpscQueue *queue, void *item)
+{
+    if (sem_trywait(&queue->space) == -1)
+        return -1;
+    put(queue, item);
+    return 0;
+}
+
+void spscPush(SpscQueue *queue, void *item)
+{
+    while (sem_wait(&queue->space) == -1 && errno == EINTR);
+    put(queue, item);
+}
+
+void *spscTryPop(SpscQueue *queue)
+{
+    if (sem_trywait(&queue->items) == -1)
+        return NULL;
+    return take(queue);
+}
+
+void *spscPop(SpscQueue *queue)
+{
+    while (sem_wait(&queue->items) == -1 && errno == EINTR);
+    return take(queue);
+}
@@ -0,0 +1,152 @@
+// Transfer telemetry implementation.
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "telemetry.h"
+
+static TelemetryBlock *segment = NULL; // Shared copy, NULL without a segment
+static TelemetryBlock current;         // Only touched by the link thread
+static char segmentName[64];
+
+static atomic_uint_fast64_t progress;
+
+static double lastPublish = 0;
+static double windowStart = 0; // Start of the rate window
+static uint64_t windowDone = 0;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Copy current to the segment. Readers retry while the sequence is odd or changes.
+static void publish(double time) {
+    current.updated = time;
+    lastPublish = time;
+    if (segment == NULL)
+        return;
+
+    unsigned sequence = atomic_load_explicit(&segment->sequence, memory_order_relaxed);
+    atomic_store_explicit(&segment->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    // Everything after the sequence, which stays as it is
+    size_t start = offsetof(TelemetryBlock, sequence) + sizeof(atomic_uint);
+    memcpy((char *) segment + start, (char *) &current + start, sizeof(TelemetryBlock) - start);
+
+    atomic_store_explicit(&segment->sequence, sequence + 2, memory_order_release);
+}
+
+static void printProgress() {
+    if (current.total != TELEMETRY_UNKNOWN && current.total > 0) {
+        printf("Progress: %.1f of %.1f MB (%.0f%%), %.1f kbit/s", current.done / 1e6, current.total / 1e6,
+               100.0 * current.done / current.total, current.rate * 8 / 1e3);
+        if (current.eta >= 0)
+            printf(", %.0f s left", current.eta);
+        printf("\n");
+    } else {
+        printf("Progress: %.1f MB, %.1f kbit/s\n", current.done / 1e6, current.rate * 8 / 1e3);
+    }
+}
+
+int telemetryOpen(const char *port, int role) {
+    memset(&current, 0, sizeof(current));
+    current.magic = TELEMETRY_MAGIC;
+    current.version = TELEMETRY_VERSION;
+    current.pid = getpid();
+    current.role = role;
+    current.state = TelemetryIdle;
+    current.eta = -1;
+    snprintf(current.port, sizeof(current.port), "%s", port);
+    current.started = now();
+    atomic_store(&progress, 0);
+
+    snprintf(segmentName, sizeof(segmentName), "/" TELEMETRY_PREFIX "%d", (int) current.pid);
+    int fd = shm_open(segmentName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+    if (ftruncate(fd, sizeof(TelemetryBlock)) == -1) {
+        close(fd);
+        shm_unlink(segmentName);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(TelemetryBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(segmentName);
+        return -1;
+    }
+
+    segment = (TelemetryBlock *) map;
+    atomic_init(&segment->sequence, 0);
+    publish(current.started);
+    // The magic goes last, a reader never sees a half-initialized segment
+    segment->version = TELEMETRY_VERSION;
+    segment->magic = TELEMETRY_MAGIC;
+    return 0;
+}
+
+void telemetryFile(const char *name, int index, int count, uint64_t total, uint64_t done) {
+    snprintf(current.file, sizeof(current.file), "%s", name);
+    current.fileIndex = index;
+    current.fileCount = count;
+    current.total = total;
+    current.done = done;
+    current.rate = 0;
+    current.eta = -1;
+    current.state = TelemetryRunning;
+    atomic_store(&progress, done);
+
+    double time = now();
+    windowStart = time;
+    windowDone = done;
+    publish(time);
+}
+
+void telemetryProgress(uint64_t bytes) {
+    atomic_fetch_add_explicit(&progress, bytes, memory_order_relaxed);
+}
+
+void telemetryTick() {
+    double time = now();
+    if (time - lastPublish < TELEMETRY_INTERVAL)
+        return;
+
+    current.done = atomic_load_explicit(&progress, memory_order_relaxed);
+    llstats(&current.link);
+
+    int printLine = FALSE;
+    if (time - windowStart >= TELEMETRY_CONSOLE_INTERVAL) {
+        current.rate = (current.done - windowDone) / (time - windowStart);
+        windowStart = time;
+        windowDone = current.done;
+        printLine = current.state == TelemetryRunning;
+    }
+    current.eta = -1;
+    if (current.total != TELEMETRY_UNKNOWN && current.rate > 0 && current.done <= current.total)
+        current.eta = (current.total - current.done) / current.rate;
+
+    publish(time);
+    if (printLine)
+        printProgress();
+}
+
+void telemetryClose(TelemetryState state) {
+    current.done = atomic_load(&progress);
+    current.state = state;
+    current.eta = -1;
+    llstats(&current.link);
+    publish(now());
+
+    if (segment != NULL) {
+        munmap(segment, sizeof(TelemetryBlock));
+        shm_unlink(segmentName);
+        segment = NULL;
+    }
+}
@@ -0,0 +1,193 @@
+// Link auto-tuning implementation.
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "link_layer.h"
+#include "tuning.h"
+
+// Probe packet: [C_PROBE][filler]. The receiver ignores anything before the
+// start packet, it needs no probe handling.
+#define C_PROBE 9
+
+// Frame bytes around a packet (flags, address, control, BCC1, BCC2) and the
+// header of a data packet (see application_layer.c)
+#define FRAME_OVERHEAD 6
+#define DATA_HEADER_SIZE 11
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Send one probe of size bytes. Return the time until it was acknowledged, or -1.
+// *retransmitted counts the frames sent again for it.
+static double sendProbe(unsigned char *probe, int size, unsigned long *retransmitted) {
+    LinkLayerStats before, after;
+    llstats(&before);
+    double start = now();
+    if (llwrite(probe, size) == -1)
+        return -1;
+    double elapsed = now() - start;
+    llstats(&after);
+    *retransmitted = after.retransmissions - before.retransmissions;
+    return elapsed;
+}
+
+int tuneLink(LinkProfile *profile, int maxPayload) {
+    // Filler without flag or escape bytes, so the frame size is known
+    unsigned char probe[MAX_PAYLOAD_SIZE];
+    probe[0] = C_PROBE;
+    for (int i = 1; i < MAX_PAYLOAD_SIZE; i++) {
+        probe[i] = rand() & 0xFF;
+        if (probe[i] == 0x7E || probe[i] == 0x7D)
+            probe[i] ^= 0x10;
+    }
+
+    double minSmall = INFINITY, minLarge = INFINITY;
+    double wireBytes = 0;
+    unsigned long retransmissions = 0;
+    double start = now();
+
+    for (int i = 0; i < TUNE_PROBES; i++) {
+        if (i >= TUNE_MIN_PROBES && now() - start > TUNE_BUDGET)
+            break;
+
+        int sizes[2] = {TUNE_SMALL_PROBE, MAX_PAYLOAD_SIZE};
+        for (int j = 0; j < 2; j++) {
+            unsigned long retransmitted;
+            double elapsed = sendProbe(probe, sizes[j], &retransmitted);
+            if (elapsed < 0)
+                return -1;
+
+            // The fastest probe of each size is the one without retransmissions or delays
+            if (j == 0 && elapsed < minSmall)
+                minSmall = elapsed;
+            if (j == 1 && elapsed < minLarge)
+                minLarge = elapsed;
+            wireBytes += (double) (sizes[j] + FRAME_OVERHEAD) * (1 + retransmitted);
+            retransmissions += retransmitted;
+        }
+    }
+
+    // Round trip = latency + bytes * perByte
+    double perByte = (minLarge - minSmall) / (MAX_PAYLOAD_SIZE - TUNE_SMALL_PROBE);
+    if (perByte < 1e-9)
+        perByte = 1e-9;
+    double latency = minSmall - perByte * (TUNE_SMALL_PROBE + FRAME_OVERHEAD);
+    if (latency < 0)
+        latency = 0;
+    double byteErrorRate = retransmissions / wireBytes;
+
+    // Goodput of a payload: its bytes, times the chance that the frame arrives
+    // intact, over the round trip of one attempt
+    int best = maxPayload;
+    double bestGoodput = 0;
+    for (int payload = 16; payload <= maxPayload; payload++) {
+        int frame = payload + DATA_HEADER_SIZE + FRAME_OVERHEAD;
+        double goodput = payload * pow(1 - byteErrorRate, frame) / (latency + perByte * frame);
+        if (goodput > bestGoodput) {
+            bestGoodput = goodput;
+            best = payload;
+        }
+    }
+
+    int frame = best + DATA_HEADER_SIZE + FRAME_OVERHEAD;
+    double roundTrip = latency + perByte * frame;
+    double failure = 1 - pow(1 - byteErrorRate, frame);
+
+    profile->payloadSize = best;
+    // Three round trips absorb scheduling jitter, in steps of 10 ms
+    profile->timeout = ceil(fmax(3 * roundTrip, TUNE_MIN_TIMEOUT) * 100) / 100;
+    // Enough tries that a frame is given up on less than once in a million
+    profile->nRetransmissions = 3;
+    if (failure > 0) {
+        int tries = (int) ceil(log(1e-6) / log(failure));
+        profile->nRetransmissions = tries < 3 ? 3 : tries > TUNE_MAX_TRIES ? TUNE_MAX_TRIES : tries;
+    }
+    profile->latency = latency;
+    profile->lineRate = 10 / perByte;
+    profile->byteErrorRate = byteErrorRate;
+    return 0;
+}
+
+// Path of the profile of serialPort: the port with '/' replaced by '_'
+static int profilePath(const char *serialPort, char *path, size_t size, int create) {
+    const char *dir = getenv("LL_PROFILE_DIR");
+    char defaultDir[512];
+    if (dir == NULL || dir[0] == '\0') {
+        const char *home = getenv("HOME");
+        if (home == NULL)
+            return -1;
+        snprintf(defaultDir, sizeof(defaultDir), "%s/.config", home);
+        if (create && mkdir(defaultDir, 0755) == -1 && errno != EEXIST)
+            return -1;
+        snprintf(defaultDir, sizeof(defaultDir), "%s/.config/serial_link", home);
+        dir = defaultDir;
+    }
+    if (create && mkdir(dir, 0755) == -1 && errno != EEXIST)
+        return -1;
+
+    while (*serialPort == '/')
+        serialPort++;
+    int n = snprintf(path, size, "%s/", dir);
+    for (; *serialPort != '\0' && n < (int) size - 9; serialPort++)
+        path[n++] = *serialPort == '/' ? '_' : *serialPort;
+    snprintf(path + n, size - n, ".profile");
+    return 0;
+}
+
+int loadProfile(const char *serialPort, LinkProfile *profile) {
+    char path[1024];
+    if (profilePath(serialPort, path, sizeof(path), 0) == -1)
+        return -1;
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    memset(profile, 0, sizeof(*profile));
+    char line[256], key[64];
+    double value;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || sscanf(line, "%63[^=]=%lf", key, &value) != 2)
+            continue;
+        if (strcmp(key, "payload") == 0)
+            profile->payloadSize = (int) value;
+        else if (strcmp(key, "timeout") == 0)
+            profile->timeout = value;
+        else if (strcmp(key, "tries") == 0)
+            profile->nRetransmissions = (int) value;
+        else if (strcmp(key, "latency") == 0)
+            profile->latency = value;
+        else if (strcmp(key, "line_rate") == 0)
+            profile->lineRate = value;
+        else if (strcmp(key, "byte_error_rate") == 0)
+            profile->byteErrorRate = value;
+    }
+    fclose(file);
+
+    return profile->payloadSize > 0 && profile->timeout > 0 && profile->nRetransmissions > 0 ? 0 : -1;
+}
+
+int saveProfile(const char *serialPort, const LinkProfile *profile) {
+    char path[1024];
+    if (profilePath(serialPort, path, sizeof(path), 1) == -1)
+        return -1;
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+
+    fprintf(file, "# Link profile of %s, measured by --tune\n", serialPort);
+    fprintf(file, "payload=%d\n", profile->payloadSize);
+    fprintf(file, "timeout=%g\n", profile->timeout);
+    fprintf(file, "tries=%d\n", profile->nRetransmissions);
+    fprintf(file, "latency=%g\n", profile->latency);
+    fprintf(file, "line_rate=%g\n", profile->lineRate);
+    fprintf(file, "byte_error_rate=%g\n", profile->byteErrorRate);
+    return fclose(file) == 0 ? 0 : -1;
+}
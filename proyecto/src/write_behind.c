@@ -0,0 +1,149 @@
+// Receiver write-behind implementation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "write_behind.h"
+
+#define ALIGNMENT 4096
+
+static double seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A negative offset writes at the current position, for pipes
+static int writeAll(int fd, const unsigned char *data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = offset < 0 ? write(fd, data, size) : pwrite(fd, data, size, offset);
+        if (n <= 0)
+            return -1;
+        data += n;
+        size -= n;
+        if (offset >= 0)
+            offset += n;
+    }
+    return 0;
+}
+
+// Writer thread: store each full buffer, then give it back to the receiver.
+// A NULL buffer ends the thread.
+static void *writer(void *arg) {
+    WriteBehind *wb = (WriteBehind *)arg;
+    off_t synced = 0;
+
+    WriteBuffer *buffer;
+    while ((buffer = (WriteBuffer *)spscPop(&wb->full)) != NULL) {
+        off_t end = buffer->offset + buffer->used;
+
+        if (atomic_load(&wb->error) == 0) {
+            if (writeAll(wb->fd, buffer->data, buffer->used, wb->stream ? -1 : buffer->offset) == -1) {
+                atomic_store(&wb->error, 1);
+            } else {
+                if (wb->fsyncPolicy == FsyncInterval && end - synced >= wb->fsyncInterval) {
+                    if (fdatasync(wb->fd) == -1)
+                        atomic_store(&wb->error, 1);
+                    synced = end;
+                }
+                if (wb->onWritten != NULL)
+                    wb->onWritten(wb->context, end);
+            }
+        }
+
+        spscPush(&wb->empty, buffer);
+    }
+
+    if (atomic_load(&wb->error) == 0 && wb->fsyncPolicy != FsyncNone && fdatasync(wb->fd) == -1)
+        atomic_store(&wb->error, 1);
+
+    return NULL;
+}
+
+int writeBehindStart(WriteBehind *wb, int fd, off_t offset, FsyncPolicy policy, off_t fsyncInterval,
+                     WrittenCallback onWritten, void *context)
+{
+    memset(wb, 0, sizeof(*wb));
+    wb->fd = fd;
+    wb->stream = offset == WRITE_BEHIND_STREAM;
+    wb->offset = wb->stream ? 0 : offset;
+    wb->fsyncPolicy = wb->stream ? FsyncNone : policy;
+    wb->fsyncInterval = fsyncInterval > 0 ? fsyncInterval : WRITE_BEHIND_BUFFER_SIZE;
+    wb->onWritten = onWritten;
+    wb->context = context;
+    atomic_init(&wb->error, 0);
+
+    // One extra slot in the queue of full buffers for the final NULL
+    if (spscInit(&wb->full, WRITE_BEHIND_BUFFERS + 1) == -1 || spscInit(&wb->empty, WRITE_BEHIND_BUFFERS) == -1)
+        return -1;
+
+    for (int i = 0; i < WRITE_BEHIND_BUFFERS; i++) {
+        if (posix_memalign((void **)&wb->buffers[i].data, ALIGNMENT, WRITE_BEHIND_BUFFER_SIZE) != 0)
+            return -1;
+        spscPush(&wb->empty, &wb->buffers[i]);
+    }
+
+    if (pthread_create(&wb->thread, NULL, writer, wb) != 0)
+        return -1;
+    return 0;
+}
+
+static void handOver(WriteBehind *wb) {
+    spscPush(&wb->full, wb->current);
+    wb->current = NULL;
+}
+
+int writeBehindWrite(WriteBehind *wb, off_t offset, const unsigned char *data, size_t size)
+{
+    if (atomic_load(&wb->error) != 0)
+        return -1;
+
+    if (offset != wb->offset) {
+        if (wb->current != NULL)
+            handOver(wb);
+        wb->offset = offset;
+    }
+
+    while (size > 0) {
+        if (wb->current == NULL) {
+            wb->current = (WriteBuffer *)spscPop(&wb->empty);
+            wb->current->used = 0;
+            wb->current->offset = wb->offset;
+            wb->current->started = seconds();
+        }
+
+        size_t n = WRITE_BEHIND_BUFFER_SIZE - wb->current->used;
+        if (n > size)
+            n = size;
+        memcpy(wb->current->data + wb->current->used, data, n);
+        wb->current->used += n;
+        wb->offset += n;
+        data += n;
+        size -= n;
+
+        if (wb->current->used == WRITE_BEHIND_BUFFER_SIZE)
+            handOver(wb);
+    }
+
+    if (wb->current != NULL && (wb->stream || seconds() - wb->current->started >= WRITE_BEHIND_MAX_DELAY))
+        handOver(wb);
+
+    return 0;
+}
+
+int writeBehindFinish(WriteBehind *wb)
+{
+    if (wb->current != NULL)
+        handOver(wb);
+    spscPush(&wb->full, NULL);
+    pthread_join(wb->thread, NULL);
+
+    for (int i = 0; i < WRITE_BEHIND_BUFFERS; i++)
+        free(wb->buffers[i].data);
+    spscDestroy(&wb->full);
+    spscDestroy(&wb->empty);
+
+    return atomic_load(&wb->error) == 0 ? 0 : -1;
+}
@@ -0,0 +1,213 @@
+// Converts a cable wire capture (cable -w) into a pcap file.
+// The byte stream of each direction is split into frames at the 0x7E flags and
+// destuffed, so every pcap packet is one frame as the receiver parses it:
+// address, control, BCC1, data and BCC2. Timestamps have nanosecond resolution
+// and are those of the chunk that carried the closing flag.
+// With both directions the link type is PPP_WITH_DIR (a direction byte, 1 for
+// frames from a transmitter port), with -d it is PPP_HDLC.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define FLAG 0x7E
+#define ESC 0x7D
+
+#define MAX_FRAME 65536
+#define MAX_DIRECTIONS 256
+
+#define LINKTYPE_PPP_HDLC 50
+#define LINKTYPE_PPP_WITH_DIR 204
+
+#define PCAP_MAGIC_NS 0xA1B23C4D
+
+typedef struct
+{
+    uint32_t magic;
+    uint16_t versionMajor;
+    uint16_t versionMinor;
+    int32_t thisZone;
+    uint32_t sigFigs;
+    uint32_t snapLen;
+    uint32_t linkType;
+} PcapHeader;
+
+typedef struct
+{
+    uint32_t seconds;
+    uint32_t nanoseconds;
+    uint32_t capturedLength;
+    uint32_t length;
+} PcapRecord;
+
+// Frame being reassembled in one direction
+typedef struct
+{
+    int inFrame;
+    int escaped;
+    size_t size;
+    unsigned char data[MAX_FRAME + 1]; // Direction byte + frame
+    unsigned long long frames;
+    unsigned long long noisyChunks;
+    unsigned long long droppedChunks;
+} Reassembly;
+
+static Reassembly reassembly[MAX_DIRECTIONS];
+
+static void writeFrame(FILE *out, Reassembly *r, int withDirection, uint64_t timestamp)
+{
+    const unsigned char *frame = withDirection ? r->data : r->data + 1;
+    uint32_t size = withDirection ? r->size + 1 : r->size;
+
+    PcapRecord record = {timestamp / 1000000000, timestamp % 1000000000, size, size};
+    fwrite(&record, sizeof(record), 1, out);
+    fwrite(frame, 1, size, out);
+    r->frames++;
+}
+
+// Feed the bytes of one chunk to the parser of its direction
+static void parseChunk(FILE *out, Reassembly *r, int withDirection, uint64_t timestamp,
+                       const unsigned char *buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        unsigned char byte = buf[i];
+
+        if (byte == FLAG)
+        {
+            if (r->inFrame && r->size > 0)
+                writeFrame(out, r, withDirection, timestamp);
+            r->inFrame = 1;
+            r->escaped = 0;
+            r->size = 0;
+            continue;
+        }
+
+        // Bytes outside a frame are ignored by the receiver too
+        if (!r->inFrame)
+            continue;
+
+        if (byte == ESC && !r->escaped)
+        {
+            r->escaped = 1;
+            continue;
+        }
+        if (r->escaped)
+        {
+            byte ^= 0x20;
+            r->escaped = 0;
+        }
+
+        if (r->size == MAX_FRAME)
+        {
+            r->inFrame = 0;
+            continue;
+        }
+        r->data[1 + r->size++] = byte;
+    }
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [-d DIRECTION] CAPTURE OUTPUT.pcap\n"
+           "  -d N  only frames of direction N (0 = Tx > Rx, 1 = Rx > Tx)\n",
+           name);
+}
+
+int main(int argc, char *argv[])
+{
+    int only = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            only = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind], "rb");
+    if (in == NULL)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    CaptureHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != CAPTURE_MAGIC ||
+        header.version != CAPTURE_VERSION || header.directions > MAX_DIRECTIONS)
+    {
+        printf("%s is not a cable capture\n", argv[optind]);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[optind + 1], "wb");
+    if (out == NULL)
+    {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    int withDirection = only < 0;
+    PcapHeader pcap = {PCAP_MAGIC_NS, 2, 4, 0, 0, MAX_FRAME + 1,
+                       withDirection ? LINKTYPE_PPP_WITH_DIR : LINKTYPE_PPP_HDLC};
+    fwrite(&pcap, sizeof(pcap), 1, out);
+
+    for (int d = 0; d < MAX_DIRECTIONS; d++)
+        reassembly[d].data[0] = d % 2 == 0;
+
+    unsigned char *buf = (unsigned char *)malloc(CAPTURE_BUFFER_SIZE);
+    CaptureRecord record;
+
+    while (fread(&record, sizeof(record), 1, in) == 1)
+    {
+        if (record.size > CAPTURE_BUFFER_SIZE || record.direction >= header.directions ||
+            fread(buf, 1, record.size, in) != record.size)
+        {
+            printf("Truncated or corrupted capture, stopping\n");
+            break;
+        }
+
+        Reassembly *r = &reassembly[record.direction];
+        if (record.flags & CAPTURE_NOISE)
+            r->noisyChunks++;
+
+        // The other end never saw these bytes
+        if (record.flags & CAPTURE_DROPPED)
+        {
+            r->droppedChunks++;
+            continue;
+        }
+
+        if (only >= 0 && record.direction != only)
+            continue;
+
+        parseChunk(out, r, withDirection, record.timestamp + header.realtimeOffset, buf, record.size);
+    }
+
+    for (int d = 0; d < header.directions; d++)
+    {
+        printf("Direction %d: %llu frames, %llu chunks with noise, %llu chunks dropped\n", d,
+               reassembly[d].frames, reassembly[d].noisyChunks, reassembly[d].droppedChunks);
+    }
+
+    free(buf);
+    fclose(in);
+    return fclose(out) == 0 ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+// Shows the live counters that running transfers publish in shared memory
+// (see include/telemetry.h): one block per bin/main process, or only the
+// given pids. With -w the display is refreshed until the transfers end.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+
+#define MAX_PIDS 64
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Copy a consistent snapshot of the segment of pid. Return "0" or "-1" if it
+// does not exist (any more) or is not a telemetry segment.
+static int readSegment(int pid, TelemetryBlock *block)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/" TELEMETRY_PREFIX "%d", pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return -1;
+    TelemetryBlock *segment = (TelemetryBlock *)mmap(NULL, sizeof(TelemetryBlock), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED)
+        return -1;
+
+    int result = -1;
+    if (segment->magic == TELEMETRY_MAGIC && segment->version == TELEMETRY_VERSION) {
+        // The writer makes the sequence odd while it updates the block
+        for (int tries = 0; tries < 1000; tries++) {
+            unsigned before = atomic_load_explicit(&segment->sequence, memory_order_acquire);
+            if (before & 1)
+                continue;
+            memcpy(block, segment, sizeof(TelemetryBlock));
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&segment->sequence, memory_order_relaxed) == before) {
+                result = 0;
+                break;
+            }
+        }
+    }
+    munmap(segment, sizeof(TelemetryBlock));
+    return result;
+}
+
+// Pids of every segment in /dev/shm. Return how many.
+static int findSegments(int *pids, int max)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL)
+        return 0;
+
+    int count = 0;
+    struct dirent *entry;
+    size_t prefix = strlen(TELEMETRY_PREFIX);
+    while ((entry = readdir(dir)) != NULL && count < max) {
+        if (strncmp(entry->d_name, TELEMETRY_PREFIX, prefix) == 0)
+            pids[count++] = atoi(entry->d_name + prefix);
+    }
+    closedir(dir);
+    return count;
+}
+
+static const char *stateName(int state)
+{
+    switch (state) {
+    case TelemetryIdle: return "connecting";
+    case TelemetryRunning: return "running";
+    case TelemetryDone: return "done";
+    case TelemetryFailed: return "failed";
+    default: return "?";
+    }
+}
+
+static void printBlock(const TelemetryBlock *block)
+{
+    double time = now();
+    // A process killed with the segment open leaves it behind
+    const char *state = kill(block->pid, 0) == -1 ? "gone" : stateName(block->state);
+
+    printf("pid %d  %s %s  %s", block->pid, block->role == LlTx ? "tx" : "rx", block->port, state);
+    if (block->file[0] != '\0')
+        printf("  %s (%u/%u)", block->file, block->fileIndex + 1, block->fileCount);
+    printf("\n");
+
+    if (block->total != TELEMETRY_UNKNOWN && block->total > 0)
+        printf("  %llu of %llu bytes (%.1f%%)", (unsigned long long)block->done,
+               (unsigned long long)block->total, 100.0 * block->done / block->total);
+    else
+        printf("  %llu bytes", (unsigned long long)block->done);
+    printf("  %.1f kbit/s", block->rate * 8 / 1e3);
+    if (block->eta >= 0)
+        printf("  %.0f s left", block->eta);
+    if (block->link.rtt > 0)
+        printf("  rtt %.1f ms", block->link.rtt * 1e3);
+    printf("\n");
+
+    printf("  frames %lu sent, %lu retransmitted, %lu timeouts, %lu REJ received, "
+           "%lu received, %lu rejected\n",
+           block->link.framesSent, block->link.retransmissions, block->link.timeouts,
+           block->link.rejects, block->link.framesReceived, block->link.framesRejected);
+    printf("  %.1f s elapsed, updated %.1f s ago\n", time - block->started, time - block->updated);
+}
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [-w SECONDS] [PID...]\n"
+           "Show the transfers of bin/main running on this machine, or only the given pids.\n"
+           "  -w SECONDS  refresh every SECONDS until no transfer is left\n",
+           program);
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:h")) != -1) {
+        switch (opt) {
+        case 'w':
+            interval = atof(optarg);
+            if (interval <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    int pids[MAX_PIDS];
+    int given = 0;
+    for (int i = optind; i < argc && given < MAX_PIDS; i++)
+        pids[given++] = atoi(argv[i]);
+
+    while (1) {
+        int count = given > 0 ? given : findSegments(pids, MAX_PIDS);
+        int shown = 0;
+        for (int i = 0; i < count; i++) {
+            TelemetryBlock block;
+            if (readSegment(pids[i], &block) == -1)
+                continue;
+            if (shown++ > 0)
+                printf("\n");
+            printBlock(&block);
+        }
+        if (shown == 0)
+            printf("No transfers running.\n");
+
+        if (interval == 0 || shown == 0)
+            return shown > 0 ? 0 : 1;
+        printf("\n");
+        fflush(stdout);
+        usleep(interval * 1e6);
+    }
+}